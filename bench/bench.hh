@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+namespace bench {
+
+  // runs `fn` until `min_ms` passed and returns the average ns per call
+  inline double Time(const std::function<void()> &fn, const long min_ms = 300) {
+    using Clock = std::chrono::steady_clock;
+    std::size_t calls = 0;
+    const Clock::time_point start = Clock::now();
+    Clock::duration spent;
+    do {
+      for (int i = 0; i < 16; i++) fn();
+      calls += 16;
+      spent = Clock::now() - start;
+    } while (spent < std::chrono::milliseconds(min_ms));
+    return std::chrono::duration<double, std::nano>(spent).count() / calls;
+  }
+
+  inline void Report(const char *name, const double ns, const std::size_t bytes) {
+    std::printf("  %-28s %10.0f ns  %8.1f MB/s\n", name, ns, bytes * 1e3 / ns);
+  }
+
+  // keeps the optimizer from dropping a result
+  template <typename T> inline void Keep(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+  }
+
+}
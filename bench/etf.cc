@@ -0,0 +1,48 @@
+#include "io/etf.hh"
+#include "bench.hh"
+
+// a GUILD_CREATE shaped dispatch with `members` members and channels
+static io::json Payload(const std::size_t members) {
+  io::json guild = {
+    {"id", "81384788765712384"}, {"name", "Discord API"}, {"large", true},
+    {"member_count", members}, {"owner_id", "53905483156684800"},
+    {"channels", io::json::array()}, {"members", io::json::array()}
+  };
+  for (std::size_t i = 0; i < members; i++) {
+    guild["members"].push_back({
+      {"user", {{"id", std::to_string(80351110224678912ull + i)},
+        {"username", "member" + std::to_string(i)}, {"discriminator", "1337"},
+        {"avatar", "8342729096ea3675442027381ff50dfe"}, {"bot", false}}},
+      {"roles", {"41771983423143936", "41771983423143937"}},
+      {"joined_at", "2015-04-26T06:26:56.936000+00:00"},
+      {"deaf", false}, {"mute", false}
+    });
+    if (i % 10 == 0)
+      guild["channels"].push_back({{"id", std::to_string(41771983423143937ull + i)},
+        {"type", 0}, {"name", "general"}, {"position", i / 10}, {"nsfw", false}});
+  }
+  return {{"op", 0}, {"s", 42}, {"t", "GUILD_CREATE"}, {"d", guild}};
+}
+
+int main() {
+  for (const std::size_t members : {10, 100, 1000}) {
+    const io::json payload = Payload(members);
+    const std::string text = payload.dump();
+    const std::string etf = io::Etf::encode(payload);
+    std::printf("GUILD_CREATE with %zu members: json %zu bytes, etf %zu bytes\n",
+      members, text.size(), etf.size());
+
+    bench::Report("decode json", bench::Time([&]() {
+      bench::Keep(io::json::parse(text));
+    }), text.size());
+    bench::Report("decode etf", bench::Time([&]() {
+      bench::Keep(io::Etf::decode(etf.data(), etf.size()));
+    }), etf.size());
+    bench::Report("encode json", bench::Time([&]() {
+      bench::Keep(payload.dump());
+    }), text.size());
+    bench::Report("encode etf", bench::Time([&]() {
+      bench::Keep(io::Etf::encode(payload));
+    }), etf.size());
+  }
+}
@@ -0,0 +1,162 @@
+#include "io/http.hh"
+#include "bench.hh"
+#include <map>
+
+// The line splitting parser HttpParser replaced, kept here as the baseline
+// it is measured against. Bodies are copied line by line, headers go into
+// a std::map and every line is a fresh std::string.
+namespace legacy {
+
+  class Response {
+  public:
+    int status;
+    std::string body;
+    std::string reason;
+    std::map<std::string, std::string> headers;
+  };
+
+  static std::vector<std::string> Split(std::string str, const std::string &delim) {
+    std::size_t pos;
+    std::string token;
+    std::vector<std::string> results;
+    while ((pos = str.find(delim)) != std::string::npos) {
+      token = str.substr(0, pos);
+      results.push_back(token);
+      str.erase(0, pos + delim.length());
+    }
+    if (!str.empty()) results.push_back(str);
+    return results;
+  }
+
+  class HttpParser {
+  private:
+    enum State { METHOD, HEADERS, BODY, END };
+    Response resp;
+    int csize = -1;
+    bool on_chunk = true;
+    bool chunked = false;
+    std::size_t chunk_size;
+    State state = METHOD;
+
+  public:
+    std::size_t responses = 0;
+
+    void Feed(const std::vector<char>& raw) {
+      std::string data(raw.begin(), raw.end());
+      std::vector<std::string> lines = Split(
+        std::string(data.begin(), data.end()), "\r\n");
+
+      for (std::string &line : lines) {
+        if (state == METHOD) {
+          line = line.substr(line.find(" ") + 1);
+          const std::size_t space = line.find(" ");
+          resp.reason = line.substr(space + 1);
+          resp.status = std::stoi(line.substr(0, space), nullptr, 10);
+          state = HEADERS;
+        } else if (state == HEADERS) {
+          if (line.empty()) { state = BODY; continue; }
+          const std::size_t space = line.find(": ");
+          std::string key = line.substr(0, space);
+          std::string value = line.substr(space + 2);
+          resp.headers[key] = value;
+          if (key.find("Transfer-Encoding") != std::string::npos) {
+            if (value.find("chunked") != std::string::npos) {
+              chunked = true; on_chunk = true;
+            }
+          } else if (key == "Content-Length") {
+            csize = std::stoi(value, nullptr, 10);
+          }
+        } else if (state == BODY) {
+          if (csize > 0) {
+            resp.body += line;
+            if (resp.body.size() >= (unsigned int)csize)
+              state = END;
+          } else if (chunked) {
+            if (line.size() < 1) continue;
+            if (on_chunk) {
+              on_chunk = false;
+              chunk_size = std::stoi(line, nullptr, 16);
+              if (chunk_size == 0) state = END;
+            } else {
+              on_chunk = true;
+              resp.body += line;
+            }
+          }
+        } else break;
+      }
+
+      if (state == END) {
+        state = METHOD;
+        csize = -1;
+        chunked = false;
+        responses++;
+        bench::Keep(resp.body);
+        resp.body.clear();
+        resp.headers.clear();
+      }
+    }
+  };
+
+}
+
+// a Discord API response: the usual header block and a json body of
+// `bytes`, sent with a Content-Length or in chunks of 4 KB
+static std::string Response(const std::size_t bytes, const bool chunked) {
+  std::string body = "[";
+  while (body.size() < bytes)
+    body += "{\"id\":\"81384788765712384\",\"name\":\"general\",\"type\":0},";
+  body.back() = ']';
+
+  std::string raw = "HTTP/1.1 200 OK\r\n"
+    "Date: Sat, 17 Oct 2026 12:00:00 GMT\r\n"
+    "Content-Type: application/json\r\n"
+    "Connection: keep-alive\r\n"
+    "Set-Cookie: __dcfduid=4b6f1c2a; Expires=Thu, 16-Oct-2031 12:00:00 GMT; Path=/\r\n"
+    "Strict-Transport-Security: max-age=31536000; includeSubDomains; preload\r\n"
+    "X-RateLimit-Bucket: 80c17d2f203122d936070c88c8d10f33\r\n"
+    "X-RateLimit-Limit: 5\r\n"
+    "X-RateLimit-Remaining: 4\r\n"
+    "X-RateLimit-Reset: 1792238400.123\r\n"
+    "X-RateLimit-Reset-After: 1.000\r\n"
+    "Via: 1.1 google\r\n"
+    "CF-Cache-Status: DYNAMIC\r\n"
+    "Server: cloudflare\r\n";
+  if (!chunked)
+    return raw + "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+  raw += "Transfer-Encoding: chunked\r\n\r\n";
+  char size[16];
+  for (std::size_t at = 0; at < body.size(); at += 4096) {
+    const std::size_t len = std::min<std::size_t>(4096, body.size() - at);
+    std::snprintf(size, sizeof(size), "%zx\r\n", len);
+    raw += size + body.substr(at, len) + "\r\n";
+  }
+  return raw + "0\r\n\r\n";
+}
+
+int main() {
+  for (const bool chunked : {false, true}) {
+    for (const std::size_t bytes : {256, 4096, 65536}) {
+      const std::string raw = Response(bytes, chunked);
+      const std::vector<char> packet(raw.begin(), raw.end());
+      std::printf("%s response, %zu byte body, %zu bytes on the wire\n",
+        chunked ? "chunked" : "sized", bytes, raw.size());
+
+      io::HttpParser parser;
+      std::size_t parsed = 0;
+      bench::Report("HttpParser", bench::Time([&]() {
+        parser.AddCallback("GET", [&parsed](const std::string&, const io::Response &resp) {
+          parsed += resp.body.size();
+        });
+        parser.Feed(raw.data(), raw.size());
+      }), raw.size());
+
+      legacy::HttpParser old;
+      bench::Report("legacy parser", bench::Time([&]() {
+        old.Feed(packet);
+      }), raw.size());
+      // both must have parsed what they were fed, or the numbers mean nothing
+      if (parsed == 0 || old.responses == 0) return 1;
+    }
+  }
+}
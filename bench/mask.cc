@@ -0,0 +1,39 @@
+#include "io/mask.hh"
+#include "bench.hh"
+#include <vector>
+
+// what FrameParser did per byte before io::Mask: append, then XOR
+static void Unpack(std::vector<char> &out, const char *src, std::size_t len, const char key[4]) {
+  const std::size_t start = out.size();
+  out.insert(out.end(), src, src + len);
+  for (std::size_t i = 0; i < len; i++)
+    out[start + i] ^= key[i % 4];
+}
+
+int main() {
+  const char key[4] = { 0x37, (char)0xfa, 0x21, 0x3d };
+  std::printf("kernel: %s\n", io::MaskKernel());
+  for (const std::size_t size : {1024, 16384, 65536, 1048576}) {
+    std::vector<char> payload(size);
+    for (std::size_t i = 0; i < size; i++) payload[i] = (char)(i * 31);
+    std::vector<char> out(size);
+    std::printf("%zu byte payload\n", size);
+
+    bench::Report("io::Mask", bench::Time([&]() {
+      io::Mask(out.data(), payload.data(), size, key);
+      bench::Keep(out);
+    }), size);
+    // unaligned start, as for a frame continued from the last read
+    bench::Report("io::Mask offset 3", bench::Time([&]() {
+      io::Mask(out.data() + 1, payload.data() + 1, size - 1, key, 3);
+      bench::Keep(out);
+    }), size - 1);
+
+    std::vector<char> unpacked;
+    bench::Report("byte loop", bench::Time([&]() {
+      unpacked.clear();
+      Unpack(unpacked, payload.data(), size, key);
+      bench::Keep(unpacked);
+    }), size);
+  }
+}
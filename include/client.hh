@@ -1,19 +1,43 @@
 #pragma once
 
 #include "io/rest.hh"
+#include "events.hh"
 #include "gateway.hh"
+#include "identify.hh"
+#include "snapshot.hh"
 #include "items/collection.hh"
+#include <mutex>
+#include <thread>
 
 namespace valk {
 
   class Client {
   private:
     std::vector<Gateway> shards;
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<io::Service>> loops;
+    Snapshot restored;
+    std::vector<EventHandler> handlers[static_cast<std::size_t>(Event::COUNT)];
 
   public:
     std::string token;
+    bool compress;
+    std::string encoding;
     io::Service service;
+
+    // number of event loop threads the shards are spread over.
+    // 0 keeps every shard on `service` alongside the rest client.
+    std::size_t shard_threads;
+    bool pin_threads;
+    // guards the caches below; event handlers run on their shard's thread
+    std::mutex cache_lock;
+
+    // sessions and caches are restored from this file on login when it
+    // is younger than snapshot_max_age seconds. Empty disables it.
+    std::string snapshot_path;
+    long snapshot_max_age;
     std::shared_ptr<io::RestClient> api;
+    IdentifyQueue identifier;
 
     User user;
     Collection<User> users;
@@ -23,6 +47,12 @@ namespace valk {
     Client();
 
     void login(const std::string token);
+    // stops every loop, so login returns; any thread
+    void logout();
+    bool SaveSnapshot();
+
+    void on(const Event event, const EventHandler &handler);
+    void emit(const Event event, const io::json &data) const;
   };
 
 }
\ No newline at end of file
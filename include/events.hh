@@ -0,0 +1,60 @@
+#pragma once
+
+#include "items/item.hh"
+#include <functional>
+
+namespace valk {
+
+  enum class Event : std::size_t {
+    UNKNOWN,
+    READY,
+    RESUMED,
+    CHANNEL_CREATE,
+    CHANNEL_UPDATE,
+    CHANNEL_DELETE,
+    CHANNEL_PINS_UPDATE,
+    GUILD_CREATE,
+    GUILD_UPDATE,
+    GUILD_DELETE,
+    GUILD_BAN_ADD,
+    GUILD_BAN_REMOVE,
+    GUILD_EMOJIS_UPDATE,
+    GUILD_INTEGRATIONS_UPDATE,
+    GUILD_MEMBER_ADD,
+    GUILD_MEMBER_REMOVE,
+    GUILD_MEMBER_UPDATE,
+    GUILD_MEMBERS_CHUNK,
+    GUILD_ROLE_CREATE,
+    GUILD_ROLE_UPDATE,
+    GUILD_ROLE_DELETE,
+    MESSAGE_CREATE,
+    MESSAGE_UPDATE,
+    MESSAGE_DELETE,
+    MESSAGE_DELETE_BULK,
+    MESSAGE_REACTION_ADD,
+    MESSAGE_REACTION_REMOVE,
+    MESSAGE_REACTION_REMOVE_ALL,
+    PRESENCE_UPDATE,
+    TYPING_START,
+    USER_UPDATE,
+    VOICE_STATE_UPDATE,
+    VOICE_SERVER_UPDATE,
+    WEBHOOKS_UPDATE,
+    COUNT
+  };
+
+  using EventHandler = std::function<void(const io::json&)>;
+
+  // FNV-1a, usable both at compile time for case labels
+  // and at runtime on the event name of a dispatch
+  constexpr uint32_t EventHash(const char *name, const std::size_t len) {
+    uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < len; i++)
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    return hash;
+  }
+
+  const char* EventName(const Event event);
+  const Event EventFromName(const std::string &name);
+
+}
@@ -1,17 +1,26 @@
 #pragma once
 
 #include "io/ws.hh"
+#include "io/etf.hh"
+#include "io/zlib.hh"
 #include "items/items.hh"
+#include "events.hh"
+#include <chrono>
+#include <deque>
+#include <mutex>
 
 namespace valk {
 
   class Client;
   class Gateway {
   private:
+    bool etf;
     std::string url;
+    io::Service *service;
     std::size_t shard_id;
     std::size_t max_shards;
     std::shared_ptr<io::WebsockClient> conn;
+    std::shared_ptr<io::ZlibStream> inflater;
 
     bool resume;
     long interval;
@@ -19,20 +28,55 @@ namespace valk {
     std::size_t seq;
     io::Timer *heartbeat;
     std::string session_id;
+    // seq and session_id are written on the shard's loop only; this guards
+    // those writes against readers on other threads, such as SaveSnapshot
+    std::unique_ptr<std::mutex> session_lock;
+    std::size_t pending_guilds;
+
+    // set by READY or RESUMED: until then Discord closes the connection on
+    // anything but heartbeat, IDENTIFY and RESUME, so the queue waits
+    bool authenticated;
+    // outgoing command token bucket, refilled at COMMAND_LIMIT per COMMAND_WINDOW
+    double tokens;
+    io::Timer *flusher;
+    bool flush_pending;
+    bool presence_pending;
+    io::json presence;
+    std::deque<io::json> commands;
+    std::deque<io::json> member_requests;
+    std::chrono::steady_clock::time_point refilled;
 
     void beat();
+    void flush();
+    void refill();
+    void write(const io::json &payload);
+    void open();
     void identify();
     void stop_beating();
     void start_beating();
+    void invalidate(const Event type, const io::json &data);
     void dispatch(const std::string &event, const io::json &data);
+    void process(const char *data, const std::size_t len);
+    void handle(const char *data, const std::size_t len);
 
   public:
+    static const std::size_t COMMAND_LIMIT = 120;
+    static const long COMMAND_WINDOW = 60000;
+    static const std::size_t COMMAND_RESERVED = 5;
+
     Client *client;
 
-    
-    Gateway(Client*, const std::size_t, const std::size_t);
+    Gateway(Client*, io::Service&, const std::size_t, const std::size_t);
+
+    io::Service& getService();
+    const std::size_t shardId() const;
+    // safe from any thread
+    const std::size_t sequence() const;
+    const std::string sessionId() const;
+    void Restore(const std::string &session, const std::size_t last_seq);
 
     void Send(const unsigned char op, const io::json &data);
+    const std::size_t queueDepth() const;
 
     void Connect(const std::string &url);
   };
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "io/http.hh"
+#include <deque>
+
+namespace valk {
+
+  using IdentifyProgress = std::function<void(const std::size_t, const std::size_t)>;
+
+  // `hold` keeps the shard's loop running while it waits for its turn,
+  // so the loop is still there to run `start`
+  class PendingIdentify {
+  public:
+    std::size_t shard_id;
+    io::Service *loop;
+    std::shared_ptr<io::asio::io_service::work> hold;
+    std::function<void()> start;
+  };
+
+  // Paces new sessions to the gateway's session_start_limit: shards share
+  // a bucket by shard_id % max_concurrency and each bucket may identify
+  // once every IDENTIFY_DELAY ms. A shard holds at most one place in the
+  // queue. Push and Cancel may be called from any thread.
+  class IdentifyQueue {
+  private:
+    io::Service &service;
+    std::size_t shards;
+    std::size_t started;
+    std::size_t remaining;
+    std::size_t session_total;
+    long reset_after;
+    std::vector<bool> busy;
+    std::vector<std::deque<PendingIdentify>> buckets;
+    IdentifyProgress on_progress;
+
+    void drain(const std::size_t bucket);
+
+  public:
+    static const long IDENTIFY_DELAY = 5000;
+
+    IdentifyQueue(io::Service &loop);
+
+    void Configure(const io::json &limit, const std::size_t shard_count);
+    // queues `start` to run on `loop`, replacing whatever the shard had
+    // queued before. The loop is held open until then, or until Cancel.
+    void Push(const std::size_t shard_id, io::Service &loop, const std::function<void()> &start);
+    void Cancel(const std::size_t shard_id);
+
+    const std::size_t pending() const;
+    void onProgress(const IdentifyProgress &cb);
+  };
+
+}
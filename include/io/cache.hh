@@ -0,0 +1,76 @@
+#pragma once
+
+#include "json.hh"
+#include <list>
+#include <chrono>
+#include <unordered_map>
+
+namespace io {
+
+  using json = nlohmann::json;
+
+  class CachedResponse {
+  public:
+    std::string key;
+    std::string endpoint;
+    std::string etag;
+    std::vector<std::string> ids;  // snowflakes in the path
+    json data;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  typedef struct CacheStats {
+    std::size_t hits = 0;
+    std::size_t misses = 0;
+    std::size_t revalidated = 0;  // answered 304 Not Modified
+    std::size_t evicted = 0;
+    std::size_t invalidated = 0;
+  } CacheStats;
+
+  // Least recently used GET responses, keyed by endpoint and body. A
+  // response is kept when its route template ("/guilds/:id/roles"), or the
+  // default, has a time to live, or when it carries an ETag. Within the ttl
+  // it answers requests without asking the server. Past it, or from the
+  // start for an ETag-only entry, it only makes the next request
+  // conditional (If-None-Match) and answers a 304. A response with neither
+  // is not kept.
+  class ResponseCache {
+  private:
+    std::size_t capacity = 0;
+    long default_ttl = 0;
+    CacheStats stats;
+    std::list<CachedResponse> entries;
+    std::unordered_map<std::string, long> ttls;
+    std::unordered_map<std::string, std::list<CachedResponse>::iterator> index;
+    std::unordered_map<std::string, std::vector<std::string>> by_id;
+
+    void erase(std::list<CachedResponse>::iterator it);
+
+  public:
+    static std::string TemplateOf(const std::string &endpoint);
+
+    // capacity 0 disables the cache
+    void Configure(const std::size_t capacity, const long default_ttl);
+    void SetTTL(const std::string &route, const long ms);
+    const bool enabled() const;
+    const long ttlOf(const std::string &endpoint) const;
+
+    // moves the entry to the front; stale entries are returned too, so
+    // check `expires` before using them without asking the server
+    CachedResponse* find(const std::string &key,
+      const std::chrono::steady_clock::time_point &now);
+    void Store(const std::string &key, const std::string &endpoint,
+      const json &data, const std::string &etag);
+    // the server answered 304: the entry is good for another ttl
+    const json* Revalidate(const std::string &key);
+
+    // drops every entry whose path has `id` as one of its segments
+    void Invalidate(const std::string &id);
+    // drops every entry under `path`, e.g. after writing to it
+    void InvalidatePath(const std::string &path);
+
+    const std::size_t size() const;
+    const CacheStats& cacheStats() const;
+  };
+
+}
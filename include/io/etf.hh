@@ -0,0 +1,25 @@
+#pragma once
+
+#include "json.hh"
+
+namespace io {
+
+  using json = nlohmann::json;
+
+  // Erlang external term format, as spoken by the gateway with encoding=etf.
+  // Terms are decoded into the same json values the JSON encoding produces:
+  // atoms and binaries become strings, nil/true/false become null/bools,
+  // maps become objects and lists, byte lists or tuples become arrays.
+  // decode throws std::runtime_error on malformed, too deeply nested or
+  // oversized input.
+  class Etf {
+  public:
+    static const unsigned char VERSION = 131;
+    static const std::size_t MAX_DEPTH = 256;
+    static const std::size_t MAX_INFLATED = 64 * 1024 * 1024;
+
+    static json decode(const char *data, const std::size_t len);
+    static std::string encode(const json &data);
+  };
+
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <type_traits>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#endif
+
+namespace io {
+
+  template <typename T> class Future;
+  template <typename T> class Promise;
+
+  template <typename F, typename T>
+  using ResultOf = decltype(std::declval<F&>()(std::declval<const T&>()));
+
+  template <typename T> struct FutureValue { using type = T; };
+  template <typename T> struct FutureValue<Future<T>> { using type = T; };
+
+  // Result of a continuation: a plain value resolves the next future,
+  // a future is chained so its value resolves the next one.
+  template <typename R>
+  struct FutureChain {
+    template <typename F, typename T>
+    static void apply(Promise<R> &next, F &fn, const T &value) {
+      next.resolve(fn(value));
+    }
+  };
+
+  template <typename R>
+  struct FutureChain<Future<R>> {
+    template <typename F, typename T>
+    static void apply(Promise<R> &next, F &fn, const T &value) {
+      fn(value).onReady([next](const R &result) mutable {
+        next.resolve(result);
+      });
+    }
+  };
+
+  // Single-assignment value shared by a Promise and its Futures.
+  // Continuations run inline on the thread that resolves it, which for
+  // RestClient is its own event loop, so nothing hops threads.
+  template <typename T>
+  class Future {
+  private:
+    struct State {
+      T value;
+      bool ready = false;
+      std::mutex lock;
+      std::vector<std::function<void(const T&)>> continuations;
+    };
+    std::shared_ptr<State> state;
+
+    friend class Promise<T>;
+    inline Future(const std::shared_ptr<State> &s) : state(s) {}
+
+  public:
+    inline const bool ready() const {
+      std::lock_guard<std::mutex> guard(state->lock);
+      return state->ready;
+    }
+
+    // only meaningful once ready()
+    inline const T& get() const {
+      return state->value;
+    }
+
+    void onReady(const std::function<void(const T&)> &cb) const {
+      {
+        std::lock_guard<std::mutex> guard(state->lock);
+        if (!state->ready) {
+          state->continuations.push_back(cb);
+          return;
+        }
+      }
+      cb(state->value);
+    }
+
+    template <typename F>
+    Future<typename FutureValue<ResultOf<F, T>>::type> then(F fn) const {
+      using R = ResultOf<F, T>;
+      static_assert(!std::is_void<R>::value,
+        "then() continuations must return a value, use onReady() to finish a chain");
+      Promise<typename FutureValue<R>::type> next;
+      onReady([next, fn](const T &value) mutable {
+        FutureChain<R>::apply(next, fn, value);
+      });
+      return next.future();
+    }
+
+  #if defined(__cpp_impl_coroutine)
+    inline bool await_ready() const {
+      return ready();
+    }
+
+    inline void await_suspend(std::coroutine_handle<> handle) const {
+      onReady([handle](const T&) { handle.resume(); });
+    }
+
+    inline T await_resume() const {
+      return state->value;
+    }
+  #endif
+  };
+
+  template <typename T>
+  class Promise {
+  private:
+    std::shared_ptr<typename Future<T>::State> state;
+
+  public:
+    inline Promise() : state(std::make_shared<typename Future<T>::State>()) {}
+
+    inline Future<T> future() const {
+      return Future<T>(state);
+    }
+
+    void resolve(const T &value) {
+      std::vector<std::function<void(const T&)>> continuations;
+      {
+        std::lock_guard<std::mutex> guard(state->lock);
+        if (state->ready) return;
+        state->value = value;
+        state->ready = true;
+        continuations.swap(state->continuations);
+      }
+      for (const auto &cb : continuations)
+        cb(state->value);
+    }
+  };
+
+#if defined(__cpp_impl_coroutine)
+  // Fire-and-forget coroutine type for code that co_awaits Futures:
+  //   io::Task fetch(RestClient &api) {
+  //     RestResult me = co_await api.getAsync("/users/@me");
+  //     if (me.ok()) ...
+  //   }
+  class Task {
+  public:
+    struct promise_type {
+      Task get_return_object() { return Task(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+  };
+#endif
+
+}
@@ -2,20 +2,43 @@
 
 #include "uri.hh"
 #include "json.hh"
+#include "zlib.hh"
 #include <deque>
+#include <boost/utility/string_view.hpp>
 
 namespace io {
 
+  using StringView = boost::string_view;
+
+  typedef struct HeaderField {
+    uint32_t name;
+    uint32_t name_len;
+    uint32_t value;
+    uint32_t value_len;
+  } HeaderField;
+
+  // Header names and values are views into `arena`, which holds the raw
+  // header block of this response and is reused for the next one.
   class Response {
   public:
     int status;
     std::string body;
     std::string reason;
-    std::map<std::string, std::string> headers;
+    std::string arena;
+    std::vector<HeaderField> fields;
+    // set when no usable response arrived: a corrupt body, a timeout or a
+    // dropped connection. The body must not be trusted then.
+    std::string error;
+
+    const bool hasHeader(const StringView &name) const;
+    StringView header(const StringView &name) const;
+    StringView headerName(const HeaderField &field) const;
+    StringView headerValue(const HeaderField &field) const;
+    void clear();
   };
 
   using json = nlohmann::json;
-  using HeaderCallback = std::function<void(std::string&, std::string &)>;
+  using HeaderCallback = std::function<void(const StringView&, const StringView&)>;
   using HttpCallback = std::function<void(const std::string&, const Response&)>;
 
   class HttpCallbackQuery {
@@ -25,29 +48,37 @@ namespace io {
   };
 
   enum ParseState {
-    METHOD, HEADERS, BODY, END
+    METHOD, HEADERS, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILERS, END
   };
 
   class HttpParser {
   private:
     Response resp;
-    int csize = -1;
-    bool on_chunk = true;
+    std::string line;
+    std::size_t mark = 0;
     bool chunked = false;
-    std::size_t chunk_size;
+    bool inflating = false;
+    GzipInflater inflater;
+    std::size_t remaining = 0;
     HeaderCallback on_header;
     std::deque<HttpCallbackQuery> callbacks;
     ParseState state = ParseState::METHOD;
 
+    void finish();
+    void appendBody(const char *data, const std::size_t len);
+    void parseHeader(const StringView &raw);
+    bool nextLine(const char *&data, std::size_t &len, StringView &out, bool to_arena);
+
   public:
     HttpParser();
 
-    static std::string gzip(const std::string &);
-    static std::string gunzip(const std::string &);
-
+    // drops a half-parsed response and every pending callback, e.g. when
+    // the connection went away with requests still unanswered
+    void Reset();
     void onHeader(const HeaderCallback& cb);
     void Feed(const std::vector<char>& data);
+    void Feed(const char *data, std::size_t len);
     void AddCallback(const std::string &route, const HttpCallback &callback);
   };
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <memory>
+#include <sstream>
+
+// Lowest level compiled in; statements below it are removed entirely.
+// 0 = trace, 1 = debug, 2 = info, 3 = warn, 4 = error
+#ifndef VALK_LOG_LEVEL
+#define VALK_LOG_LEVEL 1
+#endif
+
+// The message expression is only evaluated when the level is enabled
+#define VALK_LOG(level, expr) do { \
+    if (static_cast<int>(level) >= VALK_LOG_LEVEL && io::Logger::enabled(level)) { \
+      std::ostringstream valk_log_stream; \
+      valk_log_stream << expr; \
+      io::Logger::write(level, valk_log_stream.str()); \
+    } \
+  } while (0)
+
+#define LOG_TRACE(expr) VALK_LOG(io::LogLevel::TRACE, expr)
+#define LOG_DEBUG(expr) VALK_LOG(io::LogLevel::DEBUG, expr)
+#define LOG_INFO(expr)  VALK_LOG(io::LogLevel::INFO, expr)
+#define LOG_WARN(expr)  VALK_LOG(io::LogLevel::WARN, expr)
+#define LOG_ERROR(expr) VALK_LOG(io::LogLevel::ERROR, expr)
+
+namespace io {
+
+  enum class LogLevel : int { TRACE, DEBUG, INFO, WARN, ERROR, OFF };
+
+  // Producers push into a bounded lock-free ring, a background
+  // thread drains it and writes to stderr in batches. Messages
+  // pushed while the ring is full are dropped and counted.
+  class Logger {
+  private:
+    struct Slot {
+      std::atomic<std::size_t> seq;
+      LogLevel level;
+      std::string message;
+    };
+
+    static const std::size_t CAPACITY = 8192;
+
+    std::size_t head;
+    std::atomic<std::size_t> tail;
+    std::atomic<bool> running;
+    std::atomic<std::size_t> dropped;
+    std::unique_ptr<Slot[]> slots;
+    std::thread worker;
+
+    Logger();
+    ~Logger();
+
+    static Logger& instance();
+    static std::atomic<int> level;
+
+    bool push(const LogLevel lvl, std::string &&message);
+    std::size_t drain();
+    void run();
+
+  public:
+    static void setLevel(const LogLevel lvl);
+    static const std::size_t droppedCount();
+    static void write(const LogLevel lvl, std::string &&message);
+
+    static inline const bool enabled(const LogLevel lvl) {
+      return static_cast<int>(lvl) >= level.load(std::memory_order_relaxed);
+    }
+  };
+
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+namespace io {
+
+  // XORs `len` bytes of `src` into `dst` with the websocket masking key,
+  // starting `offset` bytes into the payload so a frame can be handled in
+  // pieces. `dst` may equal `src`. Uses AVX2 or SSE2 when the cpu has them.
+  void Mask(char *dst, const char *src, std::size_t len,
+    const char key[4], std::size_t offset = 0);
+
+  // name of the kernel Mask picked at startup: "avx2", "sse2" or "scalar"
+  const char* MaskKernel();
+
+}
@@ -1,6 +1,11 @@
 #pragma once
 
 #include "http.hh"
+#include "zlib.hh"
+#include "cache.hh"
+#include "future.hh"
+#include <atomic>
+#include <chrono>
 
 namespace io {
 
@@ -9,48 +14,216 @@ namespace io {
   static const json JSON_EMPTY = json::parse("{}");
   static const RestCallback CB_NONE = [](const json& j){};
 
+  // Outcome of a request, what the async calls resolve to. `status` is the
+  // HTTP status of the last response, 0 when none arrived. `error` says why
+  // the request failed without a usable response ("timed out", "circuit
+  // open", "connection closed", "corrupt gzip body") or that the body was
+  // not JSON; `data` is the parsed body, null on either. A 304 carries the
+  // cached data.
+  class RestResult {
+  public:
+    int status = 0;
+    std::string error;
+    json data;
+
+    // an error free 2xx or 304
+    const bool ok() const;
+  };
+
+  using RestResultCallback = std::function<void(const RestResult&)>;
+
   class RestRequest {
   public:
     json data;
+    std::string route;
     std::string method;
     std::string endpoint;
-    RestCallback callback;
+    RestResultCallback callback;
+    std::string etag;       // sent as If-None-Match
+    std::string cache_key;  // empty when the response is not cached
+    std::size_t attempts = 0;
+
+    const bool idempotent() const;
   };
 
-  class RestRoute {
-  private:
-    bool limited;
+  using Clock = std::chrono::steady_clock;
+
+  // A rate limit bucket. Several routes may share one once the server
+  // has told us their X-RateLimit-Bucket hash. Until the first response
+  // the limit is unknown and only one request is let through.
+  class RestBucket {
+  public:
+    long limit = 1;
+    long remaining = 1;
+    std::size_t inflight = 0;
+    bool timer_pending = false;
+    std::size_t failures = 0;  // in a row, trips the breaker
+    Clock::time_point reset;
+    Clock::time_point open_until;
     std::deque<RestRequest> queued;
+
+    const bool available(const Clock::time_point &now);
+  };
+
+  // Discord's global limit, requests per second over every route, checked
+  // before a bucket may send. Tokens refill continuously, so a burst of up
+  // to `rate` goes out at once and the rest are spread evenly.
+  class GlobalBucket {
+  public:
+    double rate = 50;
+    double tokens = 50;
+    Clock::time_point refilled;
+
+    const bool take(const Clock::time_point &now);
+    // when the next token is there
+    const Clock::time_point next() const;
+  };
+
+  class PipelinedRequest {
+  public:
+    std::size_t serial = 0;
+    std::size_t replays = 0;
+    bool idempotent = true;
+    std::string data;
+    std::string route;
+    HttpCallback callback;
+  };
+
+  // One keep-alive socket of the pool. Up to the pipeline depth requests
+  // are written before their responses arrive; those come back in request
+  // order, so `sent` and the parser callbacks line up. Each callback checks
+  // the serial of the request it belongs to, so once a timed out request
+  // is dropped its late response is skipped. The rest wait in `waiting`
+  // and are written as responses free up slots.
+  class RestConnection {
   public:
-    RestRoute();
-
-    void setLimited(bool state);    
-    const bool isLimited() const;
-    const bool hasPending() const;
-    void getPending(RestRequest &req);
-    const std::size_t hasLeft() const;
-    void addPending(const RestRequest &req);
+    std::size_t serial = 0;
+    HttpParser parser;
+    GzipDeflater deflater;
+    std::deque<PipelinedRequest> sent;
+    std::deque<PipelinedRequest> waiting;
+    std::shared_ptr<SSLClient> client;
+
+    const std::size_t inflight() const;
   };
 
+  typedef struct CompressionStats {
+    std::size_t requests = 0;
+    std::size_t compressed = 0;
+    std::size_t bytes_in = 0;
+    std::size_t bytes_out = 0;
+    std::size_t micros = 0;
+  } CompressionStats;
+
+  typedef struct PipelineStats {
+    std::size_t depth = 0;     // configured per connection limit
+    std::size_t inflight = 0;  // written and waiting for a response
+    std::size_t waiting = 0;   // held back by the depth limit
+    std::size_t peak = 0;      // deepest a single pipeline has been
+    std::size_t requeued = 0;  // rewritten after a connection dropped
+  } PipelineStats;
+
+  typedef struct CoalesceStats {
+    std::size_t gets = 0;  // GETs handed to the client
+    std::size_t hits = 0;  // of those, answered by one already in flight
+  } CoalesceStats;
+
+  // Failed requests (no response in `timeout` ms, a dropped connection or
+  // a 5xx) are retried up to `max_retries` times when idempotent, waiting
+  // a jittered, doubling backoff. `breaker_threshold` failures in a row on
+  // a bucket open its breaker: its requests fail at once for
+  // `breaker_cooldown` ms, then a single probe decides whether it closes.
+  typedef struct RetryPolicy {
+    long timeout = 15000;
+    std::size_t max_retries = 3;
+    long backoff_base = 250;
+    long backoff_cap = 8000;
+    std::size_t breaker_threshold = 5;
+    long breaker_cooldown = 10000;
+  } RetryPolicy;
+
+  typedef struct RetryStats {
+    std::size_t timeouts = 0;
+    std::size_t retries = 0;
+    std::size_t failed = 0;        // gave up, callback got a null json
+    std::size_t breaker_trips = 0;
+  } RetryStats;
+
   class RestClient {
   private:
     Service& service;
     std::string token;
-    HttpParser parser;
-    RestRoute globalRoute;
-    std::deque<std::string> writes;
+    std::size_t max_connections;
+    int compress_level;
+    std::size_t compress_threshold;
+    CompressionStats compression;
+    PipelineStats pipeline;
+    CoalesceStats coalesce;
+    ResponseCache cache;
+    std::atomic<bool> cache_enabled;
+    RetryPolicy policy;
+    RetryStats retry;
+    std::map<std::string, std::vector<RestResultCallback>> coalesced;
+    Clock::time_point global_reset;
+    GlobalBucket global;
     std::vector<std::string> cookies;
-    std::shared_ptr<SSLClient> client;
-    std::map<std::string, RestRoute> routes;
+    std::vector<std::unique_ptr<RestConnection>> pool;
+    std::map<std::string, RestBucket> buckets;
+    std::map<std::string, std::string> route_buckets;
+
+    void _connect(RestConnection &conn);
+    RestConnection& acquire();
 
-    void _connect();
+    void pump(RestConnection &conn);
+    void expire(RestConnection &conn, const std::size_t serial);
+    void pushRequest(RestConnection &conn, const std::string &data,
+      const std::string &route, const bool idempotent, const HttpCallback &callback);
+    void _request(const std::string& method, const std::string &endpoint,
+      const json &data, const RestResultCallback &cb);
 
-    void pushRequest(const std::string &data);
+    std::string bucketKey(const std::string &route);
+    std::string buildRequest(RestConnection &conn, const RestRequest &req);
+    void send(const std::string &key, RestRequest &&req);
+    void drain(const std::string &key);
+    void schedule(const std::string &key, const Clock::time_point &when);
+    void fail(RestRequest &req, const char *reason, const int status = 0);
+    const bool retryable(const std::string &key, RestRequest &req, const Response &resp);
+    void onResponse(const std::string &key, RestRequest &req, const Response &resp);
 
   public:
     RestClient(Service &loop);
 
     void SetToken(const std::string &token);
+    void SetPoolSize(const std::size_t max);
+    const std::size_t poolSize() const;
+
+    // how many requests each connection writes ahead of its responses
+    void SetPipelineDepth(const std::size_t depth);
+    const PipelineStats pipelineStats() const;
+
+    // requests per second allowed across all routes, 50 by default
+    void SetGlobalLimit(const std::size_t per_second);
+
+    // identical GETs in flight at the same time share one request
+    const CoalesceStats& coalesceStats() const;
+
+    // GET response cache, off until given a capacity. `default_ttl` applies
+    // to routes without their own, set as templates like "/guilds/:id/roles"
+    void SetCache(const std::size_t capacity, const long default_ttl = 0);
+    void SetCacheTTL(const std::string &route, const long ms);
+    // forget cached responses mentioning the object `id`; any thread.
+    // Nothing is posted while the cache is off.
+    void InvalidateCache(const std::string &id);
+    const bool cacheEnabled() const;
+    const CacheStats& cacheStats() const;
+
+    void SetRetryPolicy(const RetryPolicy &policy);
+    const RetryPolicy& retryPolicy() const;
+    const RetryStats& retryStats() const;
+
+    // bodies under `threshold` bytes, or that do not shrink, go out plain
+    void SetCompression(const std::size_t threshold, const int level);
+    const CompressionStats& compressionStats() const;
     void Request(const std::string& method, const std::string &endpoint,
       const json &data = JSON_EMPTY, const RestCallback &cb = CB_NONE);
 
@@ -60,6 +233,17 @@ namespace io {
       const json &data=JSON_EMPTY, const RestCallback &cb = CB_NONE);
     void del(const std::string& endpoint,
       const json &data=JSON_EMPTY, const RestCallback &cb = CB_NONE);
+
+    // Same requests resolving a Future on the rest loop instead of taking
+    // a callback. Unlike the callbacks, which only see the body, the
+    // RestResult tells a failure apart from an empty or null body: check
+    // ok(), then status and error. With C++20 the Future can be co_await'ed
+    // directly.
+    Future<RestResult> RequestAsync(const std::string& method,
+      const std::string &endpoint, const json &data = JSON_EMPTY);
+    Future<RestResult> getAsync(const std::string& endpoint, const json &data = JSON_EMPTY);
+    Future<RestResult> postAsync(const std::string& endpoint, const json &data = JSON_EMPTY);
+    Future<RestResult> delAsync(const std::string& endpoint, const json &data = JSON_EMPTY);
   };
 
 }
\ No newline at end of file
@@ -3,6 +3,10 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
 
 namespace io {
 
@@ -27,17 +31,79 @@ namespace io {
     void async(const long ms, const std::function<void(Timer*)> &cb);
   };
 
+  class Slab {
+  public:
+    std::unique_ptr<char[]> data;
+    std::size_t size = 0;
+  };
+
+  // Receive buffers in power of two sizes from MIN_SLAB to MAX_SLAB, kept
+  // for reuse by every connection of a Service.
+  class SlabPool {
+  private:
+    std::mutex lock;
+    std::vector<std::vector<std::unique_ptr<char[]>>> free;
+
+    static std::size_t classOf(const std::size_t size);
+
+  public:
+    static const std::size_t MIN_SLAB = 8192;
+    static const std::size_t MAX_SLAB = 1 << 20;
+    static const std::size_t KEEP = 32;  // free slabs kept per size
+
+    SlabPool();
+
+    // rounds `size` up to the next size class
+    Slab acquire(const std::size_t size);
+    void release(Slab &slab);
+  };
+
+  // Client TLS sessions by server name. OpenSSL hands them over through
+  // the context's new session callback, including TLS 1.3 tickets that
+  // arrive after the handshake; the next connection to that host offers
+  // the session back and gets the abbreviated handshake.
+  class SessionCache {
+  private:
+    std::mutex lock;
+    std::map<std::string, SSL_SESSION*> sessions;
+
+  public:
+    ~SessionCache();
+
+    void Attach(ssl::context &ctx);
+    void Store(const std::string &host, SSL_SESSION *session);
+    void Offer(const std::string &host, SSL *ssl);
+    void Forget(const std::string &host);
+  };
+
+  typedef struct HandshakeStats {
+    std::atomic<std::size_t> handshakes{0};
+    std::atomic<std::size_t> resumed{0};
+    std::atomic<std::size_t> failed{0};
+    std::atomic<std::size_t> micros{0};  // spent in handshakes, all told
+  } HandshakeStats;
+
   class Service {
   private:
+    std::shared_ptr<SlabPool> slabs;
     std::shared_ptr<tcp::resolver> resolver;
     std::shared_ptr<ssl::context> ssl_ctx;
     std::shared_ptr<asio::io_service> loop;
+    std::shared_ptr<asio::io_service::work> work;
 
   public:
     Service();
 
     void Run();
+    // keeps Run from returning while the loop has nothing to do, until
+    // Release. A loop that ran dry is stopped and drops later posts.
+    void Hold();
+    void Release();
     ssl::context& getContext();
+    SlabPool& getSlabs();
+    // shared by every Service, as are its cached sessions and stats
+    SessionCache& getSessions();
+    HandshakeStats& handshakeStats();
     asio::io_service& getService();
 
     Timer* createTimer();
@@ -47,18 +113,54 @@ namespace io {
       std::function<void(const error_code&, tcp::resolver::iterator)> cb);
   };
 
+  using WriteCallback = std::function<void(const error_code&)>;
+  // Gets every byte received and not consumed yet, valid only during the
+  // call, and returns how many it consumed. The rest is handed over again,
+  // followed by new data, after the next read.
+  using ReadCallback = std::function<std::size_t(const char*, const std::size_t)>;
+
+  class PendingWrite {
+  public:
+    std::string owned;
+    asio::const_buffer head;
+    asio::const_buffer body;
+    WriteCallback done;
+  };
+
+  // Writes are queued and at most one is outstanding, so TLS records never
+  // interleave and data goes out in Send order. Whatever queued up while a
+  // write was in flight leaves in the next one.
   class SSLClient {
   private:
     Service &service;
     bool connected = false;
-    std::vector<char> builder;
-    std::array<char, 8192> buffer;
+    bool writing = false;
+    bool shutting_down = false;
+    std::size_t in_flight = 0;
+    std::size_t queued_bytes = 0;
+    std::deque<PendingWrite> writes;
+    std::vector<char> outgoing;
+    Slab slab;
+    std::size_t read_start = 0;
+    std::size_t read_end = 0;
+    std::size_t read_cap = SlabPool::MAX_SLAB / 4;
+    std::size_t small_reads = 0;
+    long handshake_micros = 0;
     std::shared_ptr<ssl::stream<tcp::socket>> sock;
+    // a Connect made while the last connection was still shutting down
+    std::function<void()> after_shutdown;
 
     std::function<void(const error_code&)> on_close;
     std::function<void(const error_code&)> on_connect;
-    std::function<void(const std::vector<char>&)> on_read;
+    ReadCallback on_read;
+
+    void newStream();
+    void resize(const std::size_t size);
+    void startRead();
 
+    void flush();
+    void _write_handler(const error_code&, std::size_t);
+    void failWrites(const error_code&);
     void _read_handler(const error_code&, std::size_t);
     void _connect_handler(const error_code&, tcp::resolver::iterator,
       std::function<void(const error_code&)> callback);
@@ -66,15 +168,39 @@ namespace io {
       std::function<void(const error_code&)> callback);
 
   public:
+    static const std::size_t MAX_BATCH = 64 * 1024;
+    // a batch buffer grown past this by one big write is let go afterwards
+    static const std::size_t MAX_KEPT = 2 * MAX_BATCH;
+
     SSLClient(Service& loop);
+    ~SSLClient();
 
+    // every connection gets a stream of its own: an SSL object is done
+    // once shut down. Called during a shutdown, it waits for it to end.
     void Connect(const std::string& host, int port);
+    // copies `data`, it may go away as soon as this returns
     void Send(const char* data, const std::size_t len);
+    // writes both buffers in one go; they must stay alive until `done`
+    void Send(const asio::const_buffer &head, const asio::const_buffer &body,
+      const WriteCallback &done);
     void Close(const error_code& err, bool callback = true);
+    // drops the socket without a TLS shutdown, for peers that stopped answering
+    void Abort(const error_code& err);
 
     const bool isConnected() const;
+    // what is waiting to be written, the write in flight included
+    const std::size_t queueBytes() const;
+    const std::size_t queueLength() const;
+
+    // reads start at MIN_SLAB and double while they fill the buffer, up to
+    // `cap`; a run of small reads shrinks the buffer again
+    void SetReadCap(const std::size_t cap);
+    const std::size_t readSize() const;
+    // how long the last handshake took and whether it resumed a session
+    const long handshakeMicros() const;
+    const bool isResumed() const;
     void onClose(std::function<void(const error_code&)>);
     void onConnect(std::function<void(const error_code&)>);
-    void onRead(std::function<void(const std::vector<char>&)>);
+    void onRead(const ReadCallback&);
   };
 }
\ No newline at end of file
@@ -26,20 +26,84 @@ namespace io {
     std::vector<char> data;
   };
 
+  // An outgoing frame. The header is built in place and the masked payload
+  // reuses the buffer of an earlier frame, so once the pool is warm sending
+  // allocates nothing. A slot stays taken until its write completes.
+  class FrameSlot {
+  public:
+    static const std::size_t MAX_HEADER = 14;
+    static const std::size_t MAX_KEPT = 1 << 20;
+
+    char header[MAX_HEADER];
+    std::size_t header_size = 0;
+    std::vector<char> payload;
+  };
+
   enum WebsockState { OPEN, CLOSED, CONNECTING };
 
+  enum FrameState { FRAME_HEAD, FRAME_SIZE, FRAME_MASK, FRAME_DATA };
+
+  // A frame longer than MAX_FRAME is refused before anything is allocated
+  // for it: the error callback gets 1009 and the rest of the input is
+  // ignored until Reset.
+  class FrameParser {
+  public:
+    static const std::size_t MAX_FRAME = 16 << 20;
+
+  private:
+    Frame frame;
+    char mask[4];
+    char header[8];
+    std::size_t size;
+    std::size_t needed;
+    std::size_t filled;
+    bool failed;
+    FrameState state = FrameState::FRAME_HEAD;
+    std::function<void(Frame&)> on_frame;
+    std::function<void(const int, const std::string&)> on_error;
+
+    void beginData();
+    void finishFrame();
+
+  public:
+    FrameParser();
+
+    void Reset();
+    void Feed(const char *data, std::size_t len);
+    void onFrame(const std::function<void(Frame&)>&);
+    void onError(const std::function<void(const int, const std::string&)>&);
+  };
+
+  // on_close runs once per connection: after the closing handshake, when
+  // the socket drops (1006), or when the server does not answer our CLOSE
+  // within CLOSE_TIMEOUT ms.
   class WebsockClient {
+  public:
+    static const std::size_t MAX_MESSAGE = 64 << 20;
+    static const long CLOSE_TIMEOUT = 5000;
+
   private:
     bool connected;
+    bool reported;
+    std::size_t generation;
     Service &service;
     std::shared_ptr<SSLClient> client;
 
     Uri uri;
-    Frame frame;
     WebsockState state;
+    FrameParser parser;
     std::vector<char> builder;
+    unsigned char builder_opcode;
+    std::vector<std::unique_ptr<FrameSlot>> slots;
+    std::vector<FrameSlot*> free_slots;
 
-    void processFrame();
+    FrameSlot* takeSlot();
+    void sendFrame(unsigned char opcode, const char *data, const std::size_t len,
+      const std::function<void()> &done = nullptr);
+    void sendClose(int status, const std::string &reason, const std::function<void()> &done);
+    void drop(int status, const std::string &reason);
+    void finish(int status, const std::string &reason);
+    void processFrame(Frame &frame);
 
     std::function<void()> on_connect;
     std::function<void(const Frame&)> on_frame;
@@ -54,6 +118,8 @@ namespace io {
 
     void Send(const std::string &data,
       unsigned char opcode = Opcode::TEXT);
+    void Send(const char *data, const std::size_t len,
+      unsigned char opcode = Opcode::TEXT);
 
     void onConnect(const std::function<void()>&);
     void onFrame(const std::function<void(const Frame&)>&);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <zlib.h>
+#include <string>
+#include <vector>
+
+namespace io {
+
+  // Persistent inflate context for a zlib-stream transport. Every message
+  // shares one deflate window and ends with the Z_SYNC_FLUSH suffix.
+  class ZlibStream {
+  private:
+    z_stream strm;
+    bool failed;
+    bool complete;
+    std::size_t length;
+    std::vector<char> output;
+
+  public:
+    static const std::size_t CHUNK = 16384;
+
+    ZlibStream();
+    ~ZlibStream();
+    ZlibStream(const ZlibStream&) = delete;
+    ZlibStream& operator=(const ZlibStream&) = delete;
+
+    void Reset();
+    bool Feed(const char *data, const std::size_t len);
+
+    const bool hasFailed() const;
+    const char* data() const;
+    const std::size_t size() const;
+  };
+
+  // Reusable gzip deflate context. The stream is reset, not rebuilt,
+  // between messages and compresses into a buffer kept across calls.
+  class GzipDeflater {
+  private:
+    int level;
+    z_stream strm;
+    std::string output;
+
+  public:
+    GzipDeflater(const int level = Z_DEFAULT_COMPRESSION);
+    ~GzipDeflater();
+    GzipDeflater(const GzipDeflater&) = delete;
+    GzipDeflater& operator=(const GzipDeflater&) = delete;
+
+    void setLevel(const int level);
+    const std::string& Compress(const char *data, const std::size_t len);
+  };
+
+  // Reusable gzip/zlib inflate context for HTTP bodies: bytes are
+  // inflated as they arrive and appended to the caller's buffer.
+  class GzipInflater {
+  private:
+    z_stream strm;
+    bool failed;
+
+  public:
+    GzipInflater();
+    ~GzipInflater();
+    GzipInflater(const GzipInflater&) = delete;
+    GzipInflater& operator=(const GzipInflater&) = delete;
+
+    void Reset();
+    const bool hasFailed() const;
+    bool Feed(const char *data, const std::size_t len, std::string &out);
+  };
+
+}
\ No newline at end of file
@@ -1,79 +1,261 @@
 #pragma once
 
 #include "item.hh"
+#include <deque>
+#include <iterator>
+#include <type_traits>
 
 namespace valk {
 
+  template <typename T>
+  struct SnowflakeOf {
+    static inline snowflake get(const T &item) { return item.id; }
+  };
+
+  template <typename T>
+  struct SnowflakeOf<T*> {
+    static inline snowflake get(T *const &item) { return item->id; }
+  };
+
+  // Items keyed by snowflake. Storage is a deque and an erased item only
+  // leaves a tombstone whose position the next insert reuses, so pointers
+  // and references to the other items stay valid for as long as those
+  // items are in the collection. Iteration skips the tombstones.
+  // An open addressing index (linear probing, backward shift deletion)
+  // maps each id to its position for O(1) lookup, insert and erase.
   template <typename T>
   class Collection {
   private:
-    std::vector<T> items;
+    static const uint32_t EMPTY = 0xffffffff;
+
+    struct Slot {
+      snowflake key;
+      uint32_t index;
+    };
+
+    std::deque<T> items;
+    std::vector<bool> live;
+    std::vector<uint32_t> vacant;
+    std::vector<Slot> slots;
+
+    template <typename Value, typename Items>
+    class Iterator {
+    private:
+      Items *items;
+      const std::vector<bool> *live;
+      std::size_t pos;
+
+      inline void skip() {
+        while (pos < live->size() && !(*live)[pos]) pos++;
+      }
+
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef typename std::remove_const<Value>::type value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef Value* pointer;
+      typedef Value& reference;
+
+      inline Iterator(Items *items, const std::vector<bool> *live, const std::size_t pos) :
+        items(items), live(live), pos(pos) { skip(); }
+
+      inline Value& operator* () const { return (*items)[pos]; }
+      inline Value* operator-> () const { return &(*items)[pos]; }
+      inline Iterator& operator++ () { pos++; skip(); return *this; }
+      inline Iterator operator++ (int) { Iterator it = *this; ++*this; return it; }
+      inline bool operator== (const Iterator &other) const { return pos == other.pos; }
+      inline bool operator!= (const Iterator &other) const { return pos != other.pos; }
+    };
+
+    static inline std::size_t hash(snowflake key) {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdull;
+      key ^= key >> 33;
+      return static_cast<std::size_t>(key);
+    }
+
+    std::size_t probe(const snowflake key) const {
+      const std::size_t mask = slots.size() - 1;
+      std::size_t pos = hash(key) & mask;
+      while (slots[pos].index != EMPTY && slots[pos].key != key)
+        pos = (pos + 1) & mask;
+      return pos;
+    }
+
+    void rehash(const std::size_t capacity) {
+      slots.assign(capacity, Slot{0, EMPTY});
+      for (std::size_t i = 0; i < items.size(); i++) {
+        if (!live[i]) continue;
+        const snowflake key = SnowflakeOf<T>::get(items[i]);
+        slots[probe(key)] = Slot{key, static_cast<uint32_t>(i)};
+      }
+    }
+
+    void reserveIndex(const std::size_t count) {
+      std::size_t capacity = slots.empty() ? 16 : slots.size();
+      while (count * 4 >= capacity * 3) capacity <<= 1;
+      if (capacity != slots.size()) rehash(capacity);
+    }
+
+    void unlink(std::size_t pos) {
+      const std::size_t mask = slots.size() - 1;
+      slots[pos].index = EMPTY;
+      for (std::size_t next = (pos + 1) & mask;
+           slots[next].index != EMPTY; next = (next + 1) & mask) {
+        const std::size_t home = hash(slots[next].key) & mask;
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+          slots[pos] = slots[next];
+          slots[next].index = EMPTY;
+          pos = next;
+        }
+      }
+    }
+
+    // a tombstone when there is one, else a new position at the end
+    template <typename Item>
+    T& place(const std::size_t pos, const snowflake key, Item&& item) {
+      uint32_t index;
+      if (!vacant.empty()) {
+        index = vacant.back();
+        vacant.pop_back();
+        items[index] = std::forward<Item>(item);
+        live[index] = true;
+      } else {
+        index = static_cast<uint32_t>(items.size());
+        items.push_back(std::forward<Item>(item));
+        live.push_back(true);
+      }
+      slots[pos] = Slot{key, index};
+      return items[index];
+    }
 
   public:
+    typedef Iterator<T, std::deque<T>> iterator;
+    typedef Iterator<const T, const std::deque<T>> const_iterator;
+
     inline Collection() {}
-    inline Collection(const std::vector<T>& i) : 
-      items(i) {}
-    inline Collection(const std::size_t size) :
-      items(size) {}
+    inline Collection(const std::vector<T>& i) {
+      reserveIndex(i.size());
+      for (const T& item : i) insert(item);
+    }
+    // only sizes the index: the collection starts empty
+    inline explicit Collection(const std::size_t capacity) {
+      reserveIndex(capacity);
+    }
 
+    // the index-th item in iteration order, from the end when negative.
+    // Walks the storage, so this is O(n).
     T& operator[] (const long index) {
-      return items[index < 0 ? items.size() - index : index];
+      iterator it = begin();
+      std::advance(it, index < 0 ? size() + index : index);
+      return *it;
     }
 
-    inline std::vector<T>& get() {
-      return items;
+    inline const std::size_t size() const {
+      return items.size() - vacant.size();
     }
 
-    inline const std::size_t size() const {
-      return items.size();
+    inline iterator begin() {
+      return iterator(&items, &live, 0);
     }
 
-    inline typename std::vector<T>::iterator begin() {
-      return items.begin();
+    inline const_iterator begin() const {
+      return const_iterator(&items, &live, 0);
     }
 
-    inline typename std::vector<T>::const_iterator begin() const {
-      return items.begin();
+    inline iterator end() {
+      return iterator(&items, &live, items.size());
     }
 
-    inline typename std::vector<T>::iterator end() {
-      return items.end();
+    inline const_iterator end() const {
+      return const_iterator(&items, &live, items.size());
     }
 
-    inline typename std::vector<T>::const_iterator end() const {
-      return items.end();
+    inline void for_each(const std::function<void(const T&)> apply) const {
+      std::for_each(begin(), end(), apply);
     }
 
+    // inserts the item, or replaces the one with the same id
+    T& insert(const T& item) {
+      const snowflake key = SnowflakeOf<T>::get(item);
+      reserveIndex(size() + 1);
+      const std::size_t pos = probe(key);
+      if (slots[pos].index != EMPTY)
+        return items[slots[pos].index] = item;
+      return place(pos, key, item);
+    }
 
-    inline void for_each(const std::function<void(const T&)> apply) const {
-      std::for_each(items.begin(), items.end(), apply);
+    T& insert(T&& item) {
+      const snowflake key = SnowflakeOf<T>::get(item);
+      reserveIndex(size() + 1);
+      const std::size_t pos = probe(key);
+      if (slots[pos].index != EMPTY)
+        return items[slots[pos].index] = std::move(item);
+      return place(pos, key, std::move(item));
     }
 
     Collection<T>& operator += (const T& item) {
-      items.push_back(item); return *this;
+      insert(item); return *this;
+    }
+
+    Collection<T>& operator += (T&& item) {
+      insert(std::move(item)); return *this;
     }
 
     Collection<T>& operator += (const Collection<T>& list) {
-      items.insert(items.end(), list.begin(), list.end()); return *this;
+      reserveIndex(size() + list.size());
+      for (const T& item : list) insert(item);
+      return *this;
+    }
+
+    T* get(const snowflake id) {
+      if (slots.empty()) return nullptr;
+      const std::size_t pos = probe(id);
+      return slots[pos].index == EMPTY ? nullptr : &items[slots[pos].index];
+    }
+
+    const T* get(const snowflake id) const {
+      if (slots.empty()) return nullptr;
+      const std::size_t pos = probe(id);
+      return slots[pos].index == EMPTY ? nullptr : &items[slots[pos].index];
+    }
+
+    inline const bool contains(const snowflake id) const {
+      return get(id) != nullptr;
+    }
+
+    // leaves a tombstone: nothing else moves. The erased item is reset so
+    // it lets go of what it owned right away.
+    bool erase(const snowflake id) {
+      if (slots.empty()) return false;
+      const std::size_t pos = probe(id);
+      if (slots[pos].index == EMPTY) return false;
+
+      const uint32_t index = slots[pos].index;
+      unlink(pos);
+      items[index] = T();
+      live[index] = false;
+      vacant.push_back(index);
+      return true;
     }
 
     const bool has(const std::function<bool(const T&)> &check) const {
-      return std::find(items.begin(), items.end(), check) != items.end();
+      return std::find_if(begin(), end(), check) != end();
     }
 
     T& find(const std::function<bool(const T&)> check) {
-      return *(std::find_if(items.begin(), items.end(), check));
+      return *(std::find_if(begin(), end(), check));
     }
 
     std::vector<T*> find_all(const std::function<bool(const T&)> check) {
       std::vector<T*> result;
-      auto it = std::find_if(items.begin(), items.end(), check);
-      while (it != items.end()) {
+      auto it = std::find_if(begin(), end(), check);
+      while (it != end()) {
         result.push_back(&(*it));
-        it = std::find_if(++it, items.end(), check);
+        it = std::find_if(++it, end(), check);
       }
       return std::move(result);
     }
   };
 
-}
\ No newline at end of file
+}
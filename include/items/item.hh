@@ -11,6 +11,15 @@ namespace valk {
 
   using snowflake = uint64_t;
 
+  // ids arrive as strings with encoding=json and as integers with etf
+  inline snowflake ToSnowflake(const io::json &value) {
+    if (value.is_string())
+      return std::stoull(value.get_ref<const std::string&>(), nullptr, 10);
+    if (value.is_number())
+      return value.get<snowflake>();
+    return 0;
+  }
+
   class Item {
   public:
     snowflake id;
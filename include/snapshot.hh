@@ -0,0 +1,36 @@
+#pragma once
+
+#include "items/items.hh"
+#include <ctime>
+
+namespace valk {
+
+  typedef struct ShardSession {
+    std::size_t seq;
+    std::size_t shard_id;
+    std::string session_id;
+  } ShardSession;
+
+  // Compact binary image of the gateway sessions and the user and guild
+  // caches, so a restart inside the resume window can RESUME every shard
+  // with a warm cache instead of identifying again.
+  class Snapshot {
+  public:
+    static const uint32_t MAGIC = 0x4b4c4156;
+    static const uint8_t VERSION = 1;
+
+    std::time_t saved;
+    std::size_t shard_count;
+    std::vector<ShardSession> sessions;
+    std::vector<User> users;
+    std::vector<Guild> guilds;
+
+    inline Snapshot() : saved(0), shard_count(0) {}
+
+    // false for a missing, truncated or corrupt file; the snapshot is
+    // then left half read and must be thrown away
+    bool Read(const std::string &path);
+    bool Write(const std::string &path) const;
+  };
+
+}
@@ -0,0 +1,149 @@
+#include "io/cache.hh"
+#include <sstream>
+#include <algorithm>
+
+static bool IsId(const std::string &segment) {
+  return !segment.empty() &&
+    std::all_of(segment.begin(), segment.end(), ::isdigit);
+}
+
+static std::string PathOf(const std::string &endpoint) {
+  return endpoint.substr(0, endpoint.find('?'));
+}
+
+// "/guilds/1/members/2?limit=5" -> "/guilds/:id/members/:id"
+std::string io::ResponseCache::TemplateOf(const std::string &endpoint) {
+  std::string segment, route;
+  std::istringstream path(PathOf(endpoint));
+  while (std::getline(path, segment, '/')) {
+    if (segment.empty()) continue;
+    route += "/";
+    route += IsId(segment) ? ":id" : segment;
+  }
+  return route;
+}
+
+void io::ResponseCache::Configure(const std::size_t capacity, const long default_ttl) {
+  this->capacity = capacity;
+  this->default_ttl = default_ttl;
+  while (entries.size() > capacity)
+    erase(std::prev(entries.end()));
+}
+
+void io::ResponseCache::SetTTL(const std::string &route, const long ms) {
+  ttls[route] = ms;
+}
+
+const bool io::ResponseCache::enabled() const {
+  return capacity > 0;
+}
+
+const long io::ResponseCache::ttlOf(const std::string &endpoint) const {
+  auto it = ttls.find(TemplateOf(endpoint));
+  return it == ttls.end() ? default_ttl : it->second;
+}
+
+void io::ResponseCache::erase(std::list<io::CachedResponse>::iterator it) {
+  for (const std::string &id : it->ids) {
+    auto keys = by_id.find(id);
+    if (keys == by_id.end()) continue;
+    keys->second.erase(std::remove(keys->second.begin(), keys->second.end(), it->key),
+      keys->second.end());
+    if (keys->second.empty()) by_id.erase(keys);
+  }
+  index.erase(it->key);
+  entries.erase(it);
+}
+
+io::CachedResponse* io::ResponseCache::find(const std::string &key,
+  const std::chrono::steady_clock::time_point &now)
+{
+  auto it = index.find(key);
+  if (it == index.end()) {
+    stats.misses++;
+    return nullptr;
+  }
+  entries.splice(entries.begin(), entries, it->second);
+  if (it->second->expires > now) stats.hits++;
+  else stats.misses++;
+  return &*it->second;
+}
+
+void io::ResponseCache::Store(const std::string &key, const std::string &endpoint,
+  const io::json &data, const std::string &etag)
+{
+  const long ttl = ttlOf(endpoint);
+  if (capacity == 0 || (ttl <= 0 && etag.empty())) return;
+
+  auto it = index.find(key);
+  if (it == index.end()) {
+    entries.emplace_front();
+    entries.front().key = key;
+    entries.front().endpoint = endpoint;
+    index[key] = entries.begin();
+
+    std::string segment;
+    std::istringstream path(PathOf(endpoint));
+    while (std::getline(path, segment, '/')) {
+      if (!IsId(segment)) continue;
+      std::vector<std::string> &keys = by_id[segment];
+      if (std::find(keys.begin(), keys.end(), key) == keys.end()) keys.push_back(key);
+      entries.front().ids.push_back(segment);
+    }
+  } else {
+    entries.splice(entries.begin(), entries, it->second);
+  }
+
+  io::CachedResponse &entry = entries.front();
+  entry.data = data;
+  entry.etag = etag;
+  entry.expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(ttl);
+
+  while (entries.size() > capacity) {
+    stats.evicted++;
+    erase(std::prev(entries.end()));
+  }
+}
+
+const io::json* io::ResponseCache::Revalidate(const std::string &key) {
+  auto it = index.find(key);
+  if (it == index.end()) return nullptr;
+  stats.revalidated++;
+  it->second->expires = std::chrono::steady_clock::now()
+    + std::chrono::milliseconds(ttlOf(it->second->endpoint));
+  return &it->second->data;
+}
+
+void io::ResponseCache::Invalidate(const std::string &id) {
+  auto found = by_id.find(id);
+  if (found == by_id.end()) return;
+  const std::vector<std::string> keys = found->second;
+  for (const std::string &key : keys) {
+    auto it = index.find(key);
+    if (it == index.end()) continue;
+    stats.invalidated++;
+    erase(it->second);
+  }
+}
+
+void io::ResponseCache::InvalidatePath(const std::string &path) {
+  const std::string prefix = PathOf(path);
+  for (auto it = entries.begin(); it != entries.end();) {
+    const std::string entry = PathOf(it->endpoint);
+    if (entry.compare(0, prefix.size(), prefix) == 0
+      && (entry.size() == prefix.size() || entry[prefix.size()] == '/')) {
+      stats.invalidated++;
+      erase(it++);
+    } else {
+      it++;
+    }
+  }
+}
+
+const std::size_t io::ResponseCache::size() const {
+  return entries.size();
+}
+
+const io::CacheStats& io::ResponseCache::cacheStats() const {
+  return stats;
+}
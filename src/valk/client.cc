@@ -1,6 +1,23 @@
 #include "client.hh"
+#include "io/log.hh"
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
-valk::Client::Client() {
+static void PinThread(std::thread &thread, const std::size_t index) {
+  #ifdef __linux__
+    const unsigned int cores = std::thread::hardware_concurrency();
+    if (cores == 0) return;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(index % cores, &cpuset);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpuset);
+  #endif
+}
+
+valk::Client::Client() :
+  compress(false), encoding("json"), shard_threads(0),
+  pin_threads(true), snapshot_max_age(60), identifier(service) {
   api = std::make_shared<io::RestClient>(service);
 }
 
@@ -8,16 +25,118 @@ void valk::Client::login(const std::string token) {
   api->SetToken(token);
   this->token = token;
 
+  // only a snapshot read in full and young enough is kept
+  if (!snapshot_path.empty()) {
+    Snapshot snapshot;
+    if (snapshot.Read(snapshot_path)) {
+      const long age = static_cast<long>(std::time(nullptr) - snapshot.saved);
+      if (age >= 0 && age <= snapshot_max_age) restored = std::move(snapshot);
+      else LOG_INFO("Ignoring snapshot " << snapshot_path << ", " << age << "s old");
+    } else LOG_INFO("No usable snapshot at " << snapshot_path);
+  }
+
   api->get("/gateway/bot", {}, [this](const io::json &resp) {
     const std::size_t shard_count = resp["shards"];
     const std::string url = resp["url"];
+    if (resp.find("session_start_limit") != resp.end())
+      identifier.Configure(resp["session_start_limit"], shard_count);
+    else
+      identifier.Configure(io::json(), shard_count);
+    const std::size_t loop_count = std::min(shard_threads, shard_count);
+    // a shard loop often has nothing queued, while its shards wait on the
+    // identify queue or a reconnect: hold it open until logout
+    for (std::size_t i = 0; i < loop_count; i++) {
+      loops.emplace_back(new io::Service());
+      loops.back()->Hold();
+    }
+
+    shards.reserve(shard_count);
     for (std::size_t i = 0; i < shard_count; i++) {
-      valk::Gateway gateway(this, i, shard_count);
+      io::Service &loop = loop_count > 0 ? *loops[i % loop_count] : service;
+      valk::Gateway gateway(this, loop, i, shard_count);
       shards.push_back(std::move(gateway));
     }
-    for (valk::Gateway& gateway : shards)
-      gateway.Connect(url);
+
+    // resuming needs the same shard layout, otherwise identify from scratch
+    if (restored.shard_count == shard_count && restored.sessions.size() == shard_count) {
+      std::lock_guard<std::mutex> lock(cache_lock);
+      for (const valk::User &cached : restored.users)
+        users += cached;
+      for (const valk::Guild &cached : restored.guilds)
+        guilds += cached;
+      for (const valk::ShardSession &session : restored.sessions)
+        if (session.shard_id < shard_count)
+          shards[session.shard_id].Restore(session.session_id, session.seq);
+      LOG_INFO("Restored " << shard_count << " sessions and "
+        << guilds.size() << " guilds from snapshot");
+    }
+    restored = Snapshot();
+    for (valk::Gateway& gateway : shards) {
+      gateway.getService().getService().post([&gateway, url]() {
+        gateway.Connect(url);
+      });
+    }
+
+    for (std::size_t i = 0; i < loop_count; i++) {
+      io::Service *loop = loops[i].get();
+      threads.emplace_back([loop, i]() {
+        // an exception escaping a handler would take the process down:
+        // log it and keep the loop going, Run only returns once stopped
+        for (;;) {
+          try {
+            loop->Run();
+            return;
+          } catch (const std::exception &ex) {
+            LOG_ERROR("Shard loop " << i << ": " << ex.what());
+          }
+        }
+      });
+      if (pin_threads) PinThread(threads.back(), i);
+    }
   });
 
   service.Run();
+  for (std::thread &thread : threads)
+    if (thread.joinable()) thread.join();
+}
+
+void valk::Client::logout() {
+  service.getService().dispatch([this]() {
+    for (const std::unique_ptr<io::Service> &loop : loops) {
+      loop->Release();
+      loop->getService().stop();
+    }
+    service.getService().stop();
+  });
+}
+
+bool valk::Client::SaveSnapshot() {
+  if (snapshot_path.empty()) return false;
+  Snapshot snapshot;
+  snapshot.saved = std::time(nullptr);
+  snapshot.shard_count = shards.size();
+  for (const valk::Gateway &gateway : shards) {
+    // the accessors lock, so this is safe while the shard threads run
+    ShardSession session;
+    session.session_id = gateway.sessionId();
+    if (session.session_id.empty()) continue;
+    session.seq = gateway.sequence();
+    session.shard_id = gateway.shardId();
+    snapshot.sessions.push_back(std::move(session));
+  }
+  {
+    std::lock_guard<std::mutex> lock(cache_lock);
+    snapshot.users.assign(users.begin(), users.end());
+    snapshot.guilds.assign(guilds.begin(), guilds.end());
+  }
+  return snapshot.Write(snapshot_path);
+}
+
+void valk::Client::on(const valk::Event event, const valk::EventHandler &handler) {
+  handlers[static_cast<std::size_t>(event)].push_back(handler);
+}
+
+void valk::Client::emit(const valk::Event event, const io::json &data) const {
+  for (const valk::EventHandler &handler : handlers[static_cast<std::size_t>(event)])
+    handler(data);
 }
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include "io/etf.hh"
+#include <zlib.h>
+#include <cstring>
+#include <stdexcept>
+
+static const unsigned char NEW_FLOAT_EXT       = 70;
+static const unsigned char COMPRESSED          = 80;
+static const unsigned char SMALL_INTEGER_EXT   = 97;
+static const unsigned char INTEGER_EXT         = 98;
+static const unsigned char FLOAT_EXT           = 99;
+static const unsigned char ATOM_EXT            = 100;
+static const unsigned char SMALL_TUPLE_EXT     = 104;
+static const unsigned char LARGE_TUPLE_EXT     = 105;
+static const unsigned char NIL_EXT             = 106;
+static const unsigned char STRING_EXT          = 107;
+static const unsigned char LIST_EXT            = 108;
+static const unsigned char BINARY_EXT          = 109;
+static const unsigned char SMALL_BIG_EXT       = 110;
+static const unsigned char LARGE_BIG_EXT       = 111;
+static const unsigned char SMALL_ATOM_EXT      = 115;
+static const unsigned char MAP_EXT             = 116;
+static const unsigned char ATOM_UTF8_EXT       = 118;
+static const unsigned char SMALL_ATOM_UTF8_EXT = 119;
+
+namespace {
+
+  using json = io::json;
+
+  class Decoder {
+  private:
+    const unsigned char *data;
+    std::size_t size;
+    std::size_t offset;
+    std::size_t depth;
+
+    inline void need(const std::size_t count) {
+      if (size - offset < count)
+        throw std::runtime_error("etf: unexpected end of data");
+    }
+
+    inline uint8_t read8() {
+      need(1);
+      return data[offset++];
+    }
+
+    inline uint16_t read16() {
+      need(2);
+      const uint16_t value = (data[offset] << 8) | data[offset + 1];
+      offset += 2;
+      return value;
+    }
+
+    inline uint32_t read32() {
+      need(4);
+      const uint32_t value = (uint32_t(data[offset]) << 24)
+        | (uint32_t(data[offset + 1]) << 16)
+        | (uint32_t(data[offset + 2]) << 8)
+        | uint32_t(data[offset + 3]);
+      offset += 4;
+      return value;
+    }
+
+    inline const char* readBytes(const std::size_t count) {
+      need(count);
+      const char *bytes = reinterpret_cast<const char*>(data + offset);
+      offset += count;
+      return bytes;
+    }
+
+    json atom(const std::size_t len) {
+      const char *name = readBytes(len);
+      if (len == 3 && std::memcmp(name, "nil", 3) == 0) return nullptr;
+      if (len == 4 && std::memcmp(name, "null", 4) == 0) return nullptr;
+      if (len == 4 && std::memcmp(name, "true", 4) == 0) return true;
+      if (len == 5 && std::memcmp(name, "false", 5) == 0) return false;
+      return std::string(name, len);
+    }
+
+    json big(const std::size_t digits) {
+      const bool negative = read8() != 0;
+      if (digits > 8)
+        throw std::runtime_error("etf: integer wider than 64 bits");
+      uint64_t value = 0;
+      const unsigned char *bytes =
+        reinterpret_cast<const unsigned char*>(readBytes(digits));
+      for (std::size_t i = digits; i > 0; i--)
+        value = (value << 8) | bytes[i - 1];
+      if (!negative) return value;
+      return -static_cast<int64_t>(value);
+    }
+
+    json array(const std::size_t arity) {
+      json result = json::array();
+      for (std::size_t i = 0; i < arity; i++)
+        result.push_back(term());
+      return result;
+    }
+
+    json object(const std::size_t arity) {
+      json result = json::object();
+      for (std::size_t i = 0; i < arity; i++) {
+        json key = term();
+        std::string name = key.is_string() ? key.get<std::string>() : key.dump();
+        result[name] = term();
+      }
+      return result;
+    }
+
+  public:
+    Decoder(const unsigned char *d, const std::size_t len)
+      : data(d), size(len), offset(0), depth(0) {}
+
+    json term() {
+      if (++depth > io::Etf::MAX_DEPTH)
+        throw std::runtime_error("etf: terms nested too deeply");
+      json result = value();
+      depth--;
+      return result;
+    }
+
+    json value() {
+      const uint8_t type = read8();
+      switch (type) {
+        case SMALL_INTEGER_EXT:
+          return read8();
+        case INTEGER_EXT:
+          return static_cast<int32_t>(read32());
+        case NEW_FLOAT_EXT: {
+          uint64_t bits = (uint64_t(read32()) << 32);
+          bits |= read32();
+          double value;
+          std::memcpy(&value, &bits, sizeof(value));
+          return value;
+        }
+        case FLOAT_EXT:
+          return std::stod(std::string(readBytes(31), 31));
+        case ATOM_EXT:
+        case ATOM_UTF8_EXT:
+          return atom(read16());
+        case SMALL_ATOM_EXT:
+        case SMALL_ATOM_UTF8_EXT:
+          return atom(read8());
+        case SMALL_TUPLE_EXT:
+          return array(read8());
+        case LARGE_TUPLE_EXT:
+          return array(read32());
+        case NIL_EXT:
+          return json::array();
+        case STRING_EXT: {
+          // erlang's compact form of a list of small integers, not text
+          const uint16_t len = read16();
+          const unsigned char *bytes =
+            reinterpret_cast<const unsigned char*>(readBytes(len));
+          json result = json::array();
+          for (std::size_t i = 0; i < len; i++)
+            result.push_back(bytes[i]);
+          return result;
+        }
+        case LIST_EXT: {
+          json result = array(read32());
+          need(1);
+          if (data[offset] == NIL_EXT) offset++;
+          else term();
+          return result;
+        }
+        case BINARY_EXT: {
+          const uint32_t len = read32();
+          return std::string(readBytes(len), len);
+        }
+        case SMALL_BIG_EXT:
+          return big(read8());
+        case LARGE_BIG_EXT:
+          return big(read32());
+        case MAP_EXT:
+          return object(read32());
+        default:
+          throw std::runtime_error("etf: unsupported term " + std::to_string(type));
+      }
+    }
+  };
+
+  class Encoder {
+  private:
+    std::string &out;
+
+    inline void write8(const uint8_t value) {
+      out.push_back(static_cast<char>(value));
+    }
+
+    inline void write32(const uint32_t value) {
+      write8((value >> 24) & 0xff);
+      write8((value >> 16) & 0xff);
+      write8((value >> 8) & 0xff);
+      write8(value & 0xff);
+    }
+
+    inline void atom(const char *name, const std::size_t len) {
+      write8(SMALL_ATOM_UTF8_EXT);
+      write8(static_cast<uint8_t>(len));
+      out.append(name, len);
+    }
+
+    inline void binary(const std::string &value) {
+      write8(BINARY_EXT);
+      write32(static_cast<uint32_t>(value.size()));
+      out.append(value);
+    }
+
+    void integer(const uint64_t value, const bool negative) {
+      if (!negative && value <= 0xff) {
+        write8(SMALL_INTEGER_EXT);
+        write8(static_cast<uint8_t>(value));
+      } else if (negative ? value <= 0x80000000ull : value <= 0x7fffffffull) {
+        write8(INTEGER_EXT);
+        write32(static_cast<uint32_t>(negative ? -int64_t(value) : int64_t(value)));
+      } else {
+        uint64_t rest = value;
+        char digits[8];
+        uint8_t count = 0;
+        while (rest > 0) {
+          digits[count++] = static_cast<char>(rest & 0xff);
+          rest >>= 8;
+        }
+        write8(SMALL_BIG_EXT);
+        write8(count);
+        write8(negative ? 1 : 0);
+        out.append(digits, count);
+      }
+    }
+
+  public:
+    Encoder(std::string &o) : out(o) {}
+
+    void term(const json &value) {
+      switch (value.type()) {
+        case json::value_t::null:
+          atom("nil", 3);
+          break;
+        case json::value_t::boolean:
+          if (value.get<bool>()) atom("true", 4);
+          else atom("false", 5);
+          break;
+        case json::value_t::number_unsigned:
+          integer(value.get<uint64_t>(), false);
+          break;
+        case json::value_t::number_integer: {
+          const int64_t number = value.get<int64_t>();
+          integer(number < 0 ? uint64_t(0) - uint64_t(number) : uint64_t(number), number < 0);
+          break;
+        }
+        case json::value_t::number_float: {
+          const double number = value.get<double>();
+          uint64_t bits;
+          std::memcpy(&bits, &number, sizeof(bits));
+          write8(NEW_FLOAT_EXT);
+          write32(static_cast<uint32_t>(bits >> 32));
+          write32(static_cast<uint32_t>(bits));
+          break;
+        }
+        case json::value_t::string:
+          binary(value.get_ref<const std::string&>());
+          break;
+        case json::value_t::array:
+          if (value.empty()) {
+            write8(NIL_EXT);
+            break;
+          }
+          write8(LIST_EXT);
+          write32(static_cast<uint32_t>(value.size()));
+          for (const json &item : value)
+            term(item);
+          write8(NIL_EXT);
+          break;
+        case json::value_t::object:
+          write8(MAP_EXT);
+          write32(static_cast<uint32_t>(value.size()));
+          for (auto it = value.begin(); it != value.end(); ++it) {
+            binary(it.key());
+            term(it.value());
+          }
+          break;
+        default:
+          atom("nil", 3);
+      }
+    }
+  };
+
+}
+
+io::json io::Etf::decode(const char *data, const std::size_t len) {
+  const unsigned char *bytes = reinterpret_cast<const unsigned char*>(data);
+  if (len < 1 || bytes[0] != io::Etf::VERSION)
+    throw std::runtime_error("etf: bad version byte");
+
+  if (len > 5 && bytes[1] == COMPRESSED) {
+    const uLongf expected = (uLongf(bytes[2]) << 24) | (uLongf(bytes[3]) << 16)
+      | (uLongf(bytes[4]) << 8) | uLongf(bytes[5]);
+    if (expected > io::Etf::MAX_INFLATED)
+      throw std::runtime_error("etf: compressed term too large");
+    std::vector<unsigned char> inflated(expected);
+    uLongf size = expected;
+    if (uncompress(inflated.data(), &size, bytes + 6, len - 6) != Z_OK || size != expected)
+      throw std::runtime_error("etf: bad compressed term");
+    Decoder decoder(inflated.data(), inflated.size());
+    return decoder.term();
+  }
+
+  Decoder decoder(bytes + 1, len - 1);
+  return decoder.term();
+}
+
+std::string io::Etf::encode(const io::json &data) {
+  std::string out;
+  out.reserve(64);
+  out.push_back(static_cast<char>(io::Etf::VERSION));
+  Encoder encoder(out);
+  encoder.term(data);
+  return out;
+}
@@ -0,0 +1,92 @@
+#include "events.hh"
+#include <cstring>
+
+#define EVENT(name) valk::EventHash(name, sizeof(name) - 1)
+
+static const char* EVENT_NAMES[] = {
+  "UNKNOWN",
+  "READY",
+  "RESUMED",
+  "CHANNEL_CREATE",
+  "CHANNEL_UPDATE",
+  "CHANNEL_DELETE",
+  "CHANNEL_PINS_UPDATE",
+  "GUILD_CREATE",
+  "GUILD_UPDATE",
+  "GUILD_DELETE",
+  "GUILD_BAN_ADD",
+  "GUILD_BAN_REMOVE",
+  "GUILD_EMOJIS_UPDATE",
+  "GUILD_INTEGRATIONS_UPDATE",
+  "GUILD_MEMBER_ADD",
+  "GUILD_MEMBER_REMOVE",
+  "GUILD_MEMBER_UPDATE",
+  "GUILD_MEMBERS_CHUNK",
+  "GUILD_ROLE_CREATE",
+  "GUILD_ROLE_UPDATE",
+  "GUILD_ROLE_DELETE",
+  "MESSAGE_CREATE",
+  "MESSAGE_UPDATE",
+  "MESSAGE_DELETE",
+  "MESSAGE_DELETE_BULK",
+  "MESSAGE_REACTION_ADD",
+  "MESSAGE_REACTION_REMOVE",
+  "MESSAGE_REACTION_REMOVE_ALL",
+  "PRESENCE_UPDATE",
+  "TYPING_START",
+  "USER_UPDATE",
+  "VOICE_STATE_UPDATE",
+  "VOICE_SERVER_UPDATE",
+  "WEBHOOKS_UPDATE",
+};
+
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) ==
+  static_cast<std::size_t>(valk::Event::COUNT), "event name table out of sync");
+
+const char* valk::EventName(const valk::Event event) {
+  return EVENT_NAMES[static_cast<std::size_t>(event)];
+}
+
+const valk::Event valk::EventFromName(const std::string &name) {
+  valk::Event event;
+  switch (valk::EventHash(name.data(), name.size())) {
+    case EVENT("READY"): event = valk::Event::READY; break;
+    case EVENT("RESUMED"): event = valk::Event::RESUMED; break;
+    case EVENT("CHANNEL_CREATE"): event = valk::Event::CHANNEL_CREATE; break;
+    case EVENT("CHANNEL_UPDATE"): event = valk::Event::CHANNEL_UPDATE; break;
+    case EVENT("CHANNEL_DELETE"): event = valk::Event::CHANNEL_DELETE; break;
+    case EVENT("CHANNEL_PINS_UPDATE"): event = valk::Event::CHANNEL_PINS_UPDATE; break;
+    case EVENT("GUILD_CREATE"): event = valk::Event::GUILD_CREATE; break;
+    case EVENT("GUILD_UPDATE"): event = valk::Event::GUILD_UPDATE; break;
+    case EVENT("GUILD_DELETE"): event = valk::Event::GUILD_DELETE; break;
+    case EVENT("GUILD_BAN_ADD"): event = valk::Event::GUILD_BAN_ADD; break;
+    case EVENT("GUILD_BAN_REMOVE"): event = valk::Event::GUILD_BAN_REMOVE; break;
+    case EVENT("GUILD_EMOJIS_UPDATE"): event = valk::Event::GUILD_EMOJIS_UPDATE; break;
+    case EVENT("GUILD_INTEGRATIONS_UPDATE"): event = valk::Event::GUILD_INTEGRATIONS_UPDATE; break;
+    case EVENT("GUILD_MEMBER_ADD"): event = valk::Event::GUILD_MEMBER_ADD; break;
+    case EVENT("GUILD_MEMBER_REMOVE"): event = valk::Event::GUILD_MEMBER_REMOVE; break;
+    case EVENT("GUILD_MEMBER_UPDATE"): event = valk::Event::GUILD_MEMBER_UPDATE; break;
+    case EVENT("GUILD_MEMBERS_CHUNK"): event = valk::Event::GUILD_MEMBERS_CHUNK; break;
+    case EVENT("GUILD_ROLE_CREATE"): event = valk::Event::GUILD_ROLE_CREATE; break;
+    case EVENT("GUILD_ROLE_UPDATE"): event = valk::Event::GUILD_ROLE_UPDATE; break;
+    case EVENT("GUILD_ROLE_DELETE"): event = valk::Event::GUILD_ROLE_DELETE; break;
+    case EVENT("MESSAGE_CREATE"): event = valk::Event::MESSAGE_CREATE; break;
+    case EVENT("MESSAGE_UPDATE"): event = valk::Event::MESSAGE_UPDATE; break;
+    case EVENT("MESSAGE_DELETE"): event = valk::Event::MESSAGE_DELETE; break;
+    case EVENT("MESSAGE_DELETE_BULK"): event = valk::Event::MESSAGE_DELETE_BULK; break;
+    case EVENT("MESSAGE_REACTION_ADD"): event = valk::Event::MESSAGE_REACTION_ADD; break;
+    case EVENT("MESSAGE_REACTION_REMOVE"): event = valk::Event::MESSAGE_REACTION_REMOVE; break;
+    case EVENT("MESSAGE_REACTION_REMOVE_ALL"): event = valk::Event::MESSAGE_REACTION_REMOVE_ALL; break;
+    case EVENT("PRESENCE_UPDATE"): event = valk::Event::PRESENCE_UPDATE; break;
+    case EVENT("TYPING_START"): event = valk::Event::TYPING_START; break;
+    case EVENT("USER_UPDATE"): event = valk::Event::USER_UPDATE; break;
+    case EVENT("VOICE_STATE_UPDATE"): event = valk::Event::VOICE_STATE_UPDATE; break;
+    case EVENT("VOICE_SERVER_UPDATE"): event = valk::Event::VOICE_SERVER_UPDATE; break;
+    case EVENT("WEBHOOKS_UPDATE"): event = valk::Event::WEBHOOKS_UPDATE; break;
+    default: return valk::Event::UNKNOWN;
+  }
+  // guard against an unknown name colliding with a known hash
+  if (std::strcmp(EventName(event), name.c_str()) != 0)
+    return valk::Event::UNKNOWN;
+  return event;
+}
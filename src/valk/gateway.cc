@@ -1,7 +1,7 @@
 #include "gateway.hh"
 #include "client.hh"
 #include "utils.hh"
-#include <iostream>
+#include "io/log.hh"
 
 static const unsigned char DISPATCH              = 0;
 static const unsigned char HEARTBEAT             = 1;
@@ -35,31 +35,133 @@ static inline const std::string OSName() {
 }
 
 valk::Gateway::Gateway
-(valk::Client *client, const std::size_t id, const std::size_t max)
-  : shard_id(id), max_shards(max), beat_acked(true), seq(0)
+(valk::Client *client, io::Service &loop, const std::size_t id, const std::size_t max)
+  : service(&loop), shard_id(id), max_shards(max), beat_acked(true), seq(0),
+    heartbeat(nullptr), pending_guilds(0), authenticated(false), tokens(COMMAND_LIMIT), flusher(nullptr),
+    flush_pending(false), presence_pending(false)
 {
+  session_lock.reset(new std::mutex());
   this->resume = false;
   this->client = client;
-  conn = std::make_shared<io::WebsockClient>(client->service);
+  etf = client->encoding == "etf";
+  conn = std::make_shared<io::WebsockClient>(loop);
+  if (client->compress)
+    inflater = std::make_shared<io::ZlibStream>();
+}
+
+io::Service& valk::Gateway::getService() {
+  return *service;
+}
+
+const std::size_t valk::Gateway::shardId() const {
+  return shard_id;
+}
+
+const std::size_t valk::Gateway::sequence() const {
+  std::lock_guard<std::mutex> lock(*session_lock);
+  return seq;
+}
+
+const std::string valk::Gateway::sessionId() const {
+  std::lock_guard<std::mutex> lock(*session_lock);
+  return session_id;
+}
+
+void valk::Gateway::Restore(const std::string &session, const std::size_t last_seq) {
+  std::lock_guard<std::mutex> lock(*session_lock);
+  session_id = session;
+  seq = last_seq;
+  resume = true;
+}
+
+void valk::Gateway::write(const io::json &payload) {
+  LOG_TRACE("Sending: " << payload.dump());
+  if (conn.get() == nullptr) return;
+  if (etf) conn->Send(io::Etf::encode(payload), io::Opcode::BIN);
+  else conn->Send(payload.dump());
 }
 
 void valk::Gateway::Send(const unsigned char op, const io::json& data) {
   io::json to_send = {{"op", op}, {"d", data}};
-  std::cout << "Sending: " << to_send.dump(2) << std::endl;
-  if (conn.get() != nullptr) conn->Send(to_send.dump());
+
+  // session and heartbeat commands jump the queue and may spend the
+  // tokens held back from everything else
+  if (op == HEARTBEAT || op == IDENTIFY || op == RESUME) {
+    refill();
+    if (tokens >= 1) tokens -= 1;
+    write(to_send);
+    return;
+  }
+
+  if (op == STATUS_UPDATE) {
+    presence = std::move(to_send);
+    presence_pending = true;
+  } else if (op == REQUEST_GUILD_MEMBERS) {
+    for (const io::json &queued : member_requests)
+      if (queued == to_send) return;
+    member_requests.push_back(std::move(to_send));
+  } else {
+    commands.push_back(std::move(to_send));
+  }
+  flush();
+}
+
+const std::size_t valk::Gateway::queueDepth() const {
+  return commands.size() + member_requests.size() + (presence_pending ? 1 : 0);
+}
+
+void valk::Gateway::refill() {
+  const auto now = std::chrono::steady_clock::now();
+  const double elapsed = std::chrono::duration<double, std::milli>(now - refilled).count();
+  refilled = now;
+  tokens = std::min<double>(COMMAND_LIMIT,
+    tokens + elapsed * COMMAND_LIMIT / COMMAND_WINDOW);
+}
+
+void valk::Gateway::flush() {
+  if (!authenticated || !conn->isConnected()) return;
+  refill();
+
+  // regular commands first, then the latest presence, then member requests
+  while (tokens >= COMMAND_RESERVED + 1 && queueDepth() > 0) {
+    tokens -= 1;
+    if (!commands.empty()) {
+      write(commands.front());
+      commands.pop_front();
+    } else if (presence_pending) {
+      presence_pending = false;
+      write(presence);
+    } else {
+      write(member_requests.front());
+      member_requests.pop_front();
+    }
+  }
+
+  if (queueDepth() == 0 || flush_pending) return;
+  LOG_DEBUG("Shard " << shard_id << " deferring " << queueDepth() << " commands");
+  if (flusher == nullptr) flusher = service->createTimer();
+  flush_pending = true;
+  const double missing = COMMAND_RESERVED + 1 - tokens;
+  flusher->async(static_cast<long>(missing * COMMAND_WINDOW / COMMAND_LIMIT) + 1,
+  [this](io::Timer *timer) {
+    flush_pending = false;
+    flush();
+  });
 }
 
 void valk::Gateway::start_beating() {
-  heartbeat = client->service.createTimer();
+  if (heartbeat != nullptr) return;
+  heartbeat = service->createTimer();
+  beat_acked = true;
   beat();
 }
 
+// seq survives: a RESUME after the drop has to send it
 void valk::Gateway::stop_beating() {
   if (heartbeat != nullptr) {
     delete heartbeat;
     heartbeat = nullptr;
   }
-  seq = 0;
 }
 
 void valk::Gateway::beat() {
@@ -86,6 +188,10 @@ void valk::Gateway::beat() {
 
 void valk::Gateway::identify() {
   io::json data;
+  if (!resume) {
+    std::lock_guard<std::mutex> lock(*session_lock);
+    seq = 0;
+  }
   if (!resume)
     data = {
       {"token", client->token},
@@ -117,153 +223,218 @@ void valk::Gateway::identify() {
 void valk::Gateway::Connect(const std::string &_url) {
   if (url.empty()) 
     url = _url +  (_url.back() != '/' ? "/" : "" )
-      + "?v=" + valk::GATEWAY_VERSION + "&encoding=json";
-  std::cout << "[valk] Connecting to: " << url << std::endl;
+      + "?v=" + valk::GATEWAY_VERSION + "&encoding=" + (etf ? "etf" : "json")
+      + (inflater ? "&compress=zlib-stream" : "");
+  if (inflater) inflater->Reset();
+  LOG_INFO("Connecting to: " << url);
 
   conn->onFrame([this](const io::Frame &frame) {
-    std::string data_str(frame.data.begin(), frame.data.end());
-    if (data_str.front() != '{' || data_str.back() != '}') return;
-    io::json data = io::json::parse(data_str);
-    if (data.find("s") != data.end() && !data["s"].is_null()) seq = data["s"];
-
-    std::cout << "Got: " << data.dump(2) << std::endl;
-
-    switch (data["op"].get<unsigned char>()) {
-      case HELLO: {
-        interval = data["d"]["heartbeat_interval"];
-        identify();
-        break;
-      }
-      case DISPATCH: {
-        dispatch(data["t"], data["d"]);
-        break;
-      }
-      case HEARTBEAT_ACK: {
-        std::cout << "[valk] HEARTBEAT ACK" << std::endl;
-        beat_acked = true;
-        break;
-      }
-      case RECONNECT: {
-        resume = true;
-        conn->Close(1001, "");
-        break;
-      }
-      case REQUEST_GUILD_MEMBERS: {
-        break;
-      }
-      case VOICE_STATE_UPDATE: {
-        break;
-      }
-      case INVALID_SESSION: {
-        resume = data["d"].get<bool>();
-        client->service.spawn(4000, nullptr, [this](io::Timer *timer) {
-          conn->Close(1011, "");
-          delete timer;
-        });
-        break;
+    if (frame.opcode == io::Opcode::BIN && inflater) {
+      if (!inflater->Feed(frame.data.data(), frame.data.size())) {
+        if (inflater->hasFailed())
+          conn->Close(1011, "Invalid zlib stream");
+        return;
       }
-    }
+      process(inflater->data(), inflater->size());
+    } else process(frame.data.data(), frame.data.size());
   });
 
   conn->onClose([this](const int code, const std::string &reason) {
-    std::cout << "[valk] Client closed: " << code << " " << reason << std::endl;
-    std::cout << "[valk] Reconnecting..." << std::endl;
+    LOG_WARN("Shard " << shard_id << " closed: " << code << " " << reason << ", reconnecting");
+    client->identifier.Cancel(shard_id);
     stop_beating();
-    client->service.spawn(50, nullptr, [this](io::Timer *timer) {
+    authenticated = false;
+    tokens = COMMAND_LIMIT;
+    service->spawn(50, nullptr, [this](io::Timer *timer) {
       Connect(url);
       delete timer;
     });
   });
 
+  // a new session waits for its identify slot before opening the socket:
+  // Discord drops connections that go without heartbeat or IDENTIFY for
+  // longer than its heartbeat interval, which a queued shard easily would
+  if (resume) {
+    open();
+    return;
+  }
+  client->identifier.Push(shard_id, *service, [this]() { open(); });
+}
+
+void valk::Gateway::open() {
   conn->Connect(url);
 }
 
+// A payload that does not decode, or lacks the fields its opcode needs,
+// throws. That must not reach the loop, which would end the process:
+// drop the connection and let the reconnect start over.
+void valk::Gateway::process(const char *raw, const std::size_t len) {
+  try {
+    handle(raw, len);
+  } catch (const std::exception &ex) {
+    LOG_ERROR("Shard " << shard_id << " got a bad payload: " << ex.what());
+    conn->Close(1011, "Bad payload");
+  }
+}
+
+void valk::Gateway::handle(const char *raw, const std::size_t len) {
+  io::json data;
+  if (etf) {
+    data = io::Etf::decode(raw, len);
+  } else {
+    if (len < 2 || raw[0] != '{' || raw[len - 1] != '}') return;
+    data = io::json::parse(raw, raw + len);
+  }
+  if (data.find("s") != data.end() && !data["s"].is_null()) {
+    std::lock_guard<std::mutex> lock(*session_lock);
+    seq = data["s"];
+  }
+
+  LOG_TRACE("Got: " << data.dump());
+
+  switch (data["op"].get<unsigned char>()) {
+    case HELLO: {
+      // the identify queue already paced this connection, answer right away
+      interval = data["d"]["heartbeat_interval"];
+      identify();
+      break;
+    }
+    case DISPATCH: {
+      dispatch(data["t"].get_ref<const std::string&>(), data["d"]);
+      break;
+    }
+    case HEARTBEAT_ACK: {
+      LOG_TRACE("Heartbeat ack on shard " << shard_id);
+      beat_acked = true;
+      break;
+    }
+    case RECONNECT: {
+      resume = true;
+      conn->Close(1001, "");
+      break;
+    }
+    case REQUEST_GUILD_MEMBERS: {
+      break;
+    }
+    case VOICE_STATE_UPDATE: {
+      break;
+    }
+    case INVALID_SESSION: {
+      resume = data["d"].get<bool>();
+      service->spawn(4000, nullptr, [this](io::Timer *timer) {
+        conn->Close(1011, "");
+        delete timer;
+      });
+      break;
+    }
+  }
+}
+
+static void InvalidateField(io::RestClient &api, const io::json &data, const char *field) {
+  auto it = data.find(field);
+  if (it == data.end()) return;
+  const valk::snowflake id = valk::ToSnowflake(*it);
+  if (id != 0) api.InvalidateCache(std::to_string(id));
+}
+
+// drop cached REST responses about whatever the dispatch just changed
+void valk::Gateway::invalidate(const valk::Event type, const io::json &data) {
+  io::RestClient &api = *client->api;
+  if (!api.cacheEnabled()) return;
+  switch (type) {
+    case valk::Event::GUILD_UPDATE:
+    case valk::Event::GUILD_DELETE:
+    case valk::Event::MESSAGE_UPDATE:
+    case valk::Event::MESSAGE_DELETE:
+    case valk::Event::USER_UPDATE:
+      InvalidateField(api, data, "id");
+      break;
+    case valk::Event::CHANNEL_CREATE:
+    case valk::Event::CHANNEL_UPDATE:
+    case valk::Event::CHANNEL_DELETE:
+      InvalidateField(api, data, "id");
+      InvalidateField(api, data, "guild_id");
+      break;
+    case valk::Event::GUILD_ROLE_CREATE:
+    case valk::Event::GUILD_ROLE_UPDATE:
+    case valk::Event::GUILD_ROLE_DELETE:
+    case valk::Event::GUILD_EMOJIS_UPDATE:
+      InvalidateField(api, data, "guild_id");
+      break;
+    case valk::Event::GUILD_MEMBER_ADD:
+    case valk::Event::GUILD_MEMBER_UPDATE:
+    case valk::Event::GUILD_MEMBER_REMOVE:
+      if (data.count("user")) InvalidateField(api, data["user"], "id");
+      break;
+    case valk::Event::CHANNEL_PINS_UPDATE:
+    case valk::Event::WEBHOOKS_UPDATE:
+      InvalidateField(api, data, "channel_id");
+      break;
+    default:
+      break;
+  }
+}
+
 void valk::Gateway::dispatch(const std::string &event, const io::json &data) {
-  std::cout << "Handling event: " << event << std::endl;
-
-  if (event == "READY") {
-    session_id = data["session_id"];
-    client->user.from(data["user"]);
-    client->users += client->user;
-    for (const io::json &_guild : data["guilds"]) {
-      valk::Guild guild;
-      guild.from(_guild);
-      client->guilds += std::move(guild);
+  LOG_DEBUG("Handling event: " << event);
+  const valk::Event type = valk::EventFromName(event);
+
+  switch (type) {
+    case valk::Event::READY: {
+      {
+        std::lock_guard<std::mutex> lock(*session_lock);
+        session_id = data["session_id"];
+      }
+      std::lock_guard<std::mutex> lock(client->cache_lock);
+      client->user.from(data["user"]);
+      client->users += client->user;
+      for (const io::json &_guild : data["guilds"]) {
+        valk::Guild guild;
+        guild.from(_guild);
+        guild.unavailable = true;
+        client->guilds += std::move(guild);
+      }
+      pending_guilds = data["guilds"].size();
+      if (pending_guilds == 0) start_beating();
+      authenticated = true;
+      flush();
+      break;
     }
-  } else if (event == "RESUMED") {
-
-  } else if (event == "CHANNEL_CREATE") {
-    
-  } else if (event == "CHANNEL_UPDATE") {
-    
-  } else if (event == "CHANNEL_DELETE") {
-    
-  } else if (event == "CHANNEL_PINS_UPDATE") {
-    
-  } else if (event == "GUILD_CREATE") {
-    valk::snowflake id = data["id"];
-    std::cout << "Id: " << data["id"] << std::endl;
-    valk::Guild &guild = client->guilds.find(
-      [&id](const valk::Guild &g) { return g.id == id; });
-    guild.from(data);
-    std::size_t loaded = 0;
-    for (const valk::Guild &g : client->guilds)
-      if (!g.unavailable)
-        loaded++;
-    if (loaded == client->guilds.size()) {
-      std::cout << "starting heartbeat" << std::endl;
+    case valk::Event::GUILD_CREATE: {
+      const valk::snowflake id = valk::ToSnowflake(data["id"]);
+      bool loaded = false;
+      {
+        std::lock_guard<std::mutex> lock(client->cache_lock);
+        valk::Guild *guild = client->guilds.get(id);
+        if (guild == nullptr) {
+          valk::Guild created;
+          created.from(data);
+          client->guilds += std::move(created);
+        } else {
+          loaded = guild->unavailable;
+          guild->from(data);
+          loaded = loaded && !guild->unavailable;
+        }
+      }
+      if (loaded && pending_guilds > 0 && --pending_guilds == 0) {
+        LOG_INFO("Shard " << shard_id << " loaded all guilds, starting heartbeat");
+        start_beating();
+      }
+      break;
+    }
+    case valk::Event::RESUMED: {
+      // the guilds were loaded by the session being resumed
+      LOG_INFO("Shard " << shard_id << " resumed session");
+      pending_guilds = 0;
       start_beating();
+      authenticated = true;
+      flush();
+      break;
     }
-    
-  } else if (event == "GUILD_UPDATE") {
-    
-  } else if (event == "GUILD_DELETE") {
-    
-  } else if (event == "GUILD_BAN_ADD") {
-    
-  } else if (event == "GUILD_BAN_REMOVE") {
-    
-  } else if (event == "GUILD_EMOJIS_UPDATE") {
-    
-  } else if (event == "GUILD_INTEGRATIONS_UPDATE") {
-    
-  } else if (event == "GUILD_MEMBER_ADD") {
-    
-  } else if (event == "GUILD_MEMBER_REMOVE") {
-    
-  } else if (event == "GUILD_MEMBER_UPDATE") {
-    
-  } else if (event == "GUILD_MEMBERS_CHUNK") {
-    
-  } else if (event == "GUILD_ROLE_CREATE") {
-    
-  } else if (event == "GUILD_ROLE_UPDATE") {
-    
-  } else if (event == "GUILD_ROLE_DELETE") {
-    
-  } else if (event == "MESSAGE_CREATE") {
-    
-  } else if (event == "MESSAGE_UPDATE") {
-    
-  } else if (event == "MESSAGE_DELETE") {
-    
-  } else if (event == "MESSAGE_DELETE_BULK") {
-    
-  } else if (event == "MESSAGE_REACTION_ADD") {
-    
-  } else if (event == "MESSAGE_REACTION_REMOVE") {
-    
-  } else if (event == "MESSAGE_REACTION_REMOVE_ALL") {
-    
-  } else if (event == "PRESENCE_UPDATE") {
-    
-  } else if (event == "USER_UPDATE") {
-    
-  } else if (event == "VOICE_STATE_UPDATE") {
-    
-  } else if (event == "VOICE_SERVER_UPDATE") {
-    
-  } else if (event == "WEBHOOKS_UPDATE") {
-    
+    default:
+      break;
   }
+
+  invalidate(type, data);
+  client->emit(type, data);
 }
\ No newline at end of file
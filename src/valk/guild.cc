@@ -1,5 +1,7 @@
 #include "items/guild.hh"
 
 void valk::Guild::from(const io::json &data) {
-  
+  if (data.find("id") != data.end())
+    id = valk::ToSnowflake(data["id"]);
+  unavailable = data.value("unavailable", false);
 }
\ No newline at end of file
@@ -1,24 +1,63 @@
 #include "io/http.hh"
-#include <iostream>
-#include <boost/iostreams/copy.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
-#include <boost/iostreams/filtering_streambuf.hpp>
-
-static std::vector<std::string> Split(std::string str, const std::string &delim) {
-  std::size_t pos;
-  std::string token;
-  std::vector<std::string> results;
-  while ((pos = str.find(delim)) != std::string::npos) {
-    token = str.substr(0, pos);
-    results.push_back(token);
-    str.erase(0, pos + delim.length());
-  }
-  if (!str.empty()) results.push_back(str);
-  return results;
+#include <cstring>
+
+static inline bool IEquals(const io::StringView &a, const io::StringView &b) {
+  if (a.size() != b.size()) return false;
+  for (std::size_t i = 0; i < a.size(); i++)
+    if (std::tolower(a[i]) != std::tolower(b[i])) return false;
+  return true;
+}
+
+static inline io::StringView Trim(io::StringView view) {
+  while (!view.empty() && (view.front() == ' ' || view.front() == '\t'))
+    view.remove_prefix(1);
+  while (!view.empty() && (view.back() == ' ' || view.back() == '\t' || view.back() == '\r'))
+    view.remove_suffix(1);
+  return view;
+}
+
+io::StringView io::Response::headerName(const io::HeaderField &field) const {
+  return io::StringView(arena.data() + field.name, field.name_len);
+}
+
+io::StringView io::Response::headerValue(const io::HeaderField &field) const {
+  return io::StringView(arena.data() + field.value, field.value_len);
+}
+
+const bool io::Response::hasHeader(const io::StringView &name) const {
+  for (const io::HeaderField &field : fields)
+    if (IEquals(headerName(field), name)) return true;
+  return false;
+}
+
+io::StringView io::Response::header(const io::StringView &name) const {
+  for (const io::HeaderField &field : fields)
+    if (IEquals(headerName(field), name)) return headerValue(field);
+  return io::StringView();
+}
+
+void io::Response::clear() {
+  status = 0;
+  body.clear();
+  reason.clear();
+  arena.clear();
+  fields.clear();
+  error.clear();
 }
 
 io::HttpParser::HttpParser() {
-  on_header = [](const std::string& k, const std::string &v){};
+  on_header = [](const io::StringView &k, const io::StringView &v){};
+}
+
+void io::HttpParser::Reset() {
+  callbacks.clear();
+  line.clear();
+  resp.clear();
+  mark = 0;
+  remaining = 0;
+  chunked = false;
+  inflating = false;
+  state = io::ParseState::METHOD;
 }
 
 void io::HttpParser::onHeader(const HeaderCallback &callback) {
@@ -34,94 +73,161 @@ void io::HttpParser::AddCallback
   callbacks.push_front(std::move(query));
 }
 
-std::string io::HttpParser::gzip(const std::string &data) {
-  namespace bio = boost::iostreams;
-  std::stringstream compressed;
-  std::stringstream origin(data);
-  bio::filtering_streambuf<bio::input> output;
-  output.push(bio::gzip_compressor(bio::gzip_params(
-    bio::gzip::best_compression)));
-  output.push(origin);
-  bio::copy(output, compressed);
-  return compressed.str();
+void io::HttpParser::Feed(const std::vector<char>& raw) {
+  if (!raw.empty()) Feed(raw.data(), raw.size());
 }
 
-std::string io::HttpParser::gunzip(const std::string &data) {
-  namespace bio = boost::iostreams;
-  std::stringstream compressed(data);
-  std::stringstream decompressed;
-  bio::filtering_streambuf<bio::input> output;
-  output.push(bio::gzip_decompressor());
-  output.push(compressed);
-  bio::copy(output, decompressed);
-  return decompressed.str();
+bool io::HttpParser::nextLine
+(const char *&data, std::size_t &len, io::StringView &out, bool to_arena)
+{
+  const char *nl = static_cast<const char*>(std::memchr(data, '\n', len));
+  const std::size_t count = nl == nullptr ? len : (nl - data) + 1;
+
+  // status and header lines are kept in the response arena, other lines
+  // are only copied when they straddle two reads
+  if (to_arena) {
+    resp.arena.append(data, count);
+  } else if (nl == nullptr || !line.empty()) {
+    line.append(data, count);
+  } else {
+    out = Trim(io::StringView(data, count - 1));
+  }
+  data += count;
+  len -= count;
+  if (nl == nullptr) return false;
+
+  if (to_arena) {
+    out = Trim(io::StringView(resp.arena.data() + mark, resp.arena.size() - mark - 1));
+    mark = resp.arena.size();
+  } else if (!line.empty()) {
+    out = Trim(io::StringView(line.data(), line.size() - 1));
+  }
+  return true;
 }
 
-void io::HttpParser::Feed(const std::vector<char>& raw) {
-  std::string data(raw.begin(), raw.end());
-
-  std::vector<std::string> lines = Split(
-    std::string(data.begin(), data.end()), "\r\n");
-
-  for (std::string &line : lines) {
-
-    if (state == io::ParseState::METHOD) {
-      line = line.substr(line.find(" ") + 1);
-      const std::size_t space = line.find(" ");
-      resp.reason = line.substr(space + 1);
-      resp.status = std::stoi(line.substr(0, space), nullptr, 10);
-      state = io::ParseState::HEADERS;
-
-    } else if (state == io::ParseState::HEADERS) {
-      if (line.empty()) { state = ParseState::BODY; continue; }
-      const std::size_t space = line.find(": ");
-      std::string key = line.substr(0, space);
-      std::string value = line.substr(space + 2);
-      resp.headers[key] = value;
-      if (key.find("Transfer-Encoding") != std::string::npos) {
-        if (value.find("chunked") != std::string::npos) {
-          chunked = true; on_chunk = true;
-        }
-      } else if (key == "Content-Length") {
-        csize = std::stoi(value, nullptr, 10);
+void io::HttpParser::parseHeader(const io::StringView &raw) {
+  const std::size_t colon = raw.find(':');
+  if (colon == io::StringView::npos) return;
+
+  const io::StringView name = Trim(raw.substr(0, colon));
+  const io::StringView value = Trim(raw.substr(colon + 1));
+  io::HeaderField field;
+  field.name = static_cast<uint32_t>(name.data() - resp.arena.data());
+  field.name_len = static_cast<uint32_t>(name.size());
+  field.value = static_cast<uint32_t>(value.data() - resp.arena.data());
+  field.value_len = static_cast<uint32_t>(value.size());
+  resp.fields.push_back(field);
+
+  if (IEquals(name, "Transfer-Encoding")) {
+    if (value.find("chunked") != io::StringView::npos) chunked = true;
+  } else if (IEquals(name, "Content-Length")) {
+    remaining = std::strtoul(std::string(value).c_str(), nullptr, 10);
+  }
+  on_header(name, value);
+}
+
+void io::HttpParser::Feed(const char *data, std::size_t len) {
+  io::StringView current;
+
+  while (len > 0) {
+    switch (state) {
+      case io::ParseState::METHOD: {
+        if (!nextLine(data, len, current, true)) return;
+        if (current.empty()) break;
+        current = current.substr(current.find(' ') + 1);
+        const std::size_t space = current.find(' ');
+        resp.status = std::atoi(std::string(current.substr(0, space)).c_str());
+        resp.reason = space == io::StringView::npos ?
+          std::string() : std::string(current.substr(space + 1));
+        state = io::ParseState::HEADERS;
+        break;
       }
-      on_header(key, value);
-
-    } else if (state == ParseState::BODY) {
-      if (csize > 0) {
-        resp.body += line;
-        if (resp.body.size() >= (unsigned int)csize)
-          state = io::ParseState::END;
-      } else if (chunked) {
-        if (line.size() < 1) continue;
-        if (on_chunk) {
-          on_chunk = false;
-          chunk_size = std::stoi(line, nullptr, 16);
-          if (chunk_size == 0) state = io::ParseState::END;
-        } else {
-          on_chunk = true;
-          resp.body += line;
+
+      case io::ParseState::HEADERS: {
+        if (!nextLine(data, len, current, true)) return;
+        if (!current.empty()) {
+          parseHeader(current);
+          break;
+        }
+        if (resp.header("Content-Encoding").find("gzip") != io::StringView::npos) {
+          inflating = true;
+          inflater.Reset();
         }
+        if (chunked) {
+          state = io::ParseState::CHUNK_SIZE;
+        } else if (remaining > 0) {
+          if (!inflating) resp.body.reserve(remaining);
+          state = io::ParseState::BODY;
+        } else finish();
+        break;
       }
 
-    } else break;
-  }
+      case io::ParseState::BODY:
+      case io::ParseState::CHUNK_DATA: {
+        const std::size_t count = std::min(remaining, len);
+        appendBody(data, count);
+        data += count;
+        len -= count;
+        remaining -= count;
+        if (remaining > 0) return;
+        if (state == io::ParseState::BODY) finish();
+        else state = io::ParseState::CHUNK_END;
+        break;
+      }
+
+      case io::ParseState::CHUNK_SIZE: {
+        if (!nextLine(data, len, current, false)) return;
+        remaining = std::strtoul(std::string(current).c_str(), nullptr, 16);
+        line.clear();
+        state = remaining > 0 ? io::ParseState::CHUNK_DATA : io::ParseState::TRAILERS;
+        break;
+      }
+
+      case io::ParseState::CHUNK_END: {
+        if (!nextLine(data, len, current, false)) return;
+        line.clear();
+        state = io::ParseState::CHUNK_SIZE;
+        break;
+      }
 
-  if (state == io::ParseState::END) {
-    state = io::ParseState::METHOD;
-    csize = -1;
-    chunked = true;
-
-    if (resp.headers.find("Content-Encoding") != resp.headers.end())
-      if (resp.headers["Content-Encoding"].find("gzip") != std::string::npos)
-        resp.body = gunzip(resp.body);
-
-    if (!callbacks.empty()) {
-      io::HttpCallbackQuery query = std::move(callbacks.back());
-      callbacks.pop_back();
-      query.callback(query.route, resp);
-      resp.body.clear();
-      resp.headers.clear();
+      case io::ParseState::TRAILERS: {
+        if (!nextLine(data, len, current, false)) return;
+        const bool done = current.empty();
+        line.clear();
+        if (done) finish();
+        break;
+      }
+
+      default:
+        return;
     }
   }
-}
\ No newline at end of file
+}
+
+void io::HttpParser::appendBody(const char *data, const std::size_t len) {
+  // the rest of a body that failed to inflate is still read, to keep the
+  // framing, but dropped
+  if (!resp.error.empty()) return;
+  if (!inflating) {
+    resp.body.append(data, len);
+  } else if (!inflater.Feed(data, len, resp.body)) {
+    inflating = false;
+    resp.error = "corrupt gzip body";
+    resp.body.clear();
+  }
+}
+
+void io::HttpParser::finish() {
+  if (!callbacks.empty()) {
+    io::HttpCallbackQuery query = std::move(callbacks.back());
+    callbacks.pop_back();
+    query.callback(query.route, resp);
+  }
+
+  resp.clear();
+  mark = 0;
+  remaining = 0;
+  chunked = false;
+  inflating = false;
+  state = io::ParseState::METHOD;
+}
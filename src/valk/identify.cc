@@ -0,0 +1,113 @@
+#include "identify.hh"
+#include "io/log.hh"
+
+valk::IdentifyQueue::IdentifyQueue(io::Service &loop) : service(loop) {
+  shards = 0;
+  started = 0;
+  remaining = 1;
+  session_total = 1;
+  reset_after = 0;
+  busy.resize(1, false);
+  buckets.resize(1);
+  on_progress = [](const std::size_t done, const std::size_t total) {
+    LOG_INFO("Identified " << done << "/" << total << " shards");
+  };
+}
+
+void valk::IdentifyQueue::onProgress(const valk::IdentifyProgress &cb) {
+  on_progress = cb;
+}
+
+void valk::IdentifyQueue::Configure(const io::json &limit, const std::size_t shard_count) {
+  std::size_t concurrency = 1;
+  if (limit.is_object()) {
+    if (limit.find("max_concurrency") != limit.end())
+      concurrency = std::max<std::size_t>(1, limit["max_concurrency"].get<std::size_t>());
+    if (limit.find("total") != limit.end())
+      session_total = limit["total"];
+    if (limit.find("remaining") != limit.end())
+      remaining = limit["remaining"];
+    if (limit.find("reset_after") != limit.end())
+      reset_after = limit["reset_after"];
+  }
+  shards = shard_count;
+  busy.assign(concurrency, false);
+  buckets.assign(concurrency, std::deque<valk::PendingIdentify>());
+  LOG_INFO("Identifying " << shards << " shards in " << concurrency
+    << " buckets, " << remaining << "/" << session_total << " sessions left");
+}
+
+const std::size_t valk::IdentifyQueue::pending() const {
+  std::size_t count = 0;
+  for (const auto &bucket : buckets)
+    count += bucket.size();
+  return count;
+}
+
+void valk::IdentifyQueue::Push(const std::size_t shard_id,
+  io::Service &loop, const std::function<void()> &start)
+{
+  // taken here, before the loop could run dry waiting for the dispatch
+  std::shared_ptr<io::asio::io_service::work> hold =
+    std::make_shared<io::asio::io_service::work>(loop.getService());
+  io::Service *target = &loop;
+  service.getService().dispatch([this, shard_id, target, hold, start]() {
+    std::deque<valk::PendingIdentify> &bucket = buckets[shard_id % buckets.size()];
+    for (valk::PendingIdentify &queued : bucket) {
+      if (queued.shard_id != shard_id) continue;
+      queued.loop = target;
+      queued.hold = hold;
+      queued.start = start;
+      return;
+    }
+    valk::PendingIdentify entry;
+    entry.shard_id = shard_id;
+    entry.loop = target;
+    entry.hold = hold;
+    entry.start = start;
+    bucket.push_back(std::move(entry));
+    if (!busy[shard_id % buckets.size()]) drain(shard_id % buckets.size());
+  });
+}
+
+void valk::IdentifyQueue::Cancel(const std::size_t shard_id) {
+  service.getService().dispatch([this, shard_id]() {
+    std::deque<valk::PendingIdentify> &bucket = buckets[shard_id % buckets.size()];
+    for (auto it = bucket.begin(); it != bucket.end(); it++) {
+      if (it->shard_id != shard_id) continue;
+      bucket.erase(it);
+      return;
+    }
+  });
+}
+
+void valk::IdentifyQueue::drain(const std::size_t bucket) {
+  if (buckets[bucket].empty()) {
+    busy[bucket] = false;
+    return;
+  }
+
+  busy[bucket] = true;
+  if (remaining == 0) {
+    LOG_WARN("Session start limit reached, waiting " << reset_after << "ms");
+    service.spawn(reset_after, nullptr, [this, bucket](io::Timer *timer) {
+      remaining = session_total;
+      drain(bucket);
+      delete timer;
+    });
+    return;
+  }
+
+  valk::PendingIdentify entry = std::move(buckets[bucket].front());
+  buckets[bucket].pop_front();
+  remaining--;
+  // the posted handler keeps the loop running from here on
+  entry.loop->getService().post(entry.start);
+  if (started < shards) started++;
+  on_progress(started, shards);
+
+  service.spawn(IDENTIFY_DELAY, nullptr, [this, bucket](io::Timer *timer) {
+    drain(bucket);
+    delete timer;
+  });
+}
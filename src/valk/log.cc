@@ -0,0 +1,86 @@
+#include "io/log.hh"
+#include <cstdio>
+#include <chrono>
+
+static const char* LEVEL_NAMES[] = {
+  "trace", "debug", "info", "warn", "error", "off"
+};
+
+std::atomic<int> io::Logger::level(static_cast<int>(io::LogLevel::INFO));
+
+io::Logger::Logger() : head(0), tail(0), running(true), dropped(0) {
+  slots.reset(new Slot[CAPACITY]);
+  for (std::size_t i = 0; i < CAPACITY; i++)
+    slots[i].seq.store(i, std::memory_order_relaxed);
+  worker = std::thread([this]() { run(); });
+}
+
+io::Logger::~Logger() {
+  running.store(false, std::memory_order_release);
+  if (worker.joinable()) worker.join();
+}
+
+io::Logger& io::Logger::instance() {
+  static io::Logger logger;
+  return logger;
+}
+
+void io::Logger::setLevel(const io::LogLevel lvl) {
+  level.store(static_cast<int>(lvl), std::memory_order_relaxed);
+}
+
+const std::size_t io::Logger::droppedCount() {
+  return instance().dropped.load(std::memory_order_relaxed);
+}
+
+void io::Logger::write(const io::LogLevel lvl, std::string &&message) {
+  io::Logger &logger = instance();
+  if (!logger.push(lvl, std::move(message)))
+    logger.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool io::Logger::push(const io::LogLevel lvl, std::string &&message) {
+  Slot *slot;
+  std::size_t pos = tail.load(std::memory_order_relaxed);
+  for (;;) {
+    slot = &slots[pos % CAPACITY];
+    const std::size_t seq = slot->seq.load(std::memory_order_acquire);
+    const long diff = static_cast<long>(seq) - static_cast<long>(pos);
+    if (diff == 0) {
+      if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+  slot->level = lvl;
+  slot->message = std::move(message);
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+std::size_t io::Logger::drain() {
+  std::size_t count = 0;
+  for (;;) {
+    Slot &slot = slots[head % CAPACITY];
+    if (slot.seq.load(std::memory_order_acquire) != head + 1) break;
+    std::fprintf(stderr, "[valk] %-5s %s\n",
+      LEVEL_NAMES[static_cast<int>(slot.level)], slot.message.c_str());
+    slot.message.clear();
+    slot.seq.store(head + CAPACITY, std::memory_order_release);
+    head++;
+    count++;
+  }
+  if (count > 0) std::fflush(stderr);
+  return count;
+}
+
+void io::Logger::run() {
+  while (running.load(std::memory_order_acquire)) {
+    if (drain() == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  drain();
+}
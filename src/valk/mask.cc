@@ -0,0 +1,95 @@
+#include "io/mask.hh"
+#include <cstdint>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VALK_MASK_X86 1
+#include <immintrin.h>
+#endif
+
+using MaskFn = void (*)(char*, const char*, std::size_t, uint32_t);
+
+// `key` holds the four mask bytes already rotated to the start of `src`;
+// every kernel consumes multiples of four so the rotation stays put
+static void MaskScalar(char *dst, const char *src, std::size_t len, uint32_t key) {
+  std::size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    const uint64_t wide = (static_cast<uint64_t>(key) << 32) | key;
+    std::memcpy(&word, src + i, 8);
+    word ^= wide;
+    std::memcpy(dst + i, &word, 8);
+  }
+  const char *bytes = reinterpret_cast<const char*>(&key);
+  for (; i < len; i++)
+    dst[i] = src[i] ^ bytes[i % 4];
+}
+
+#ifdef VALK_MASK_X86
+__attribute__((target("sse2")))
+static void MaskSSE2(char *dst, const char *src, std::size_t len, uint32_t key) {
+  std::size_t i = 0;
+  const __m128i wide = _mm_set1_epi32(static_cast<int>(key));
+  for (; i + 16 <= len; i += 16) {
+    const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(chunk, wide));
+  }
+  MaskScalar(dst + i, src + i, len - i, key);
+}
+
+__attribute__((target("avx2")))
+static void MaskAVX2(char *dst, const char *src, std::size_t len, uint32_t key) {
+  std::size_t i = 0;
+  const __m256i wide = _mm256_set1_epi32(static_cast<int>(key));
+  for (; i + 64 <= len; i += 64) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(a, wide));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), _mm256_xor_si256(b, wide));
+  }
+  for (; i + 32 <= len; i += 32) {
+    const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(chunk, wide));
+  }
+  MaskSSE2(dst + i, src + i, len - i, key);
+}
+#endif
+
+static MaskFn PickKernel(const char *&name) {
+#ifdef VALK_MASK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    name = "avx2";
+    return MaskAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    name = "sse2";
+    return MaskSSE2;
+  }
+#endif
+  name = "scalar";
+  return MaskScalar;
+}
+
+static const char *KernelName = "scalar";
+
+static MaskFn Kernel() {
+  static const MaskFn kernel = PickKernel(KernelName);
+  return kernel;
+}
+
+void io::Mask(char *dst, const char *src, std::size_t len,
+  const char key[4], std::size_t offset)
+{
+  char rotated[4];
+  for (std::size_t i = 0; i < 4; i++)
+    rotated[i] = key[(offset + i) % 4];
+  uint32_t word;
+  std::memcpy(&word, rotated, 4);
+  Kernel()(dst, src, len, word);
+}
+
+const char* io::MaskKernel() {
+  Kernel();
+  return KernelName;
+}
@@ -1,55 +1,233 @@
 #include "io/rest.hh"
 #include "utils.hh"
 #include <ctime>
-#include <iostream>
-
-io::RestClient::RestClient(io::Service &loop) : service(loop) {
-  client = nullptr;
-  _connect();
-  parser.onHeader([this](std::string &key, std::string &value) {
-    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-    if (key.find("set-cookie") != std::string::npos) 
-      cookies.push_back(value.substr(0, value.find(";")));
-  });
+#include <random>
+#include "io/log.hh"
+
+static std::random_device Rng;
+static std::mt19937 Random(Rng());
+
+io::RestClient::RestClient(io::Service &loop) : service(loop), max_connections(4),
+  compress_level(Z_BEST_SPEED), compress_threshold(1024), cache_enabled(false) {
+  pipeline.depth = 4;
+  acquire();
 }
 
 void io::RestClient::SetToken(const std::string &token) {
   this->token = token;
 }
 
-void io::RestClient::pushRequest(const std::string &data) {
-  if (client.get() != nullptr && client->isConnected())
-    client->Send(data.c_str(), data.size());
-  else
-    writes.push_front(std::move(data));
+void io::RestClient::SetPoolSize(const std::size_t max) {
+  max_connections = std::max<std::size_t>(1, max);
+}
+
+const std::size_t io::RestClient::poolSize() const {
+  return pool.size();
+}
+
+void io::RestClient::SetPipelineDepth(const std::size_t depth) {
+  pipeline.depth = std::max<std::size_t>(1, depth);
+}
+
+void io::RestClient::SetGlobalLimit(const std::size_t per_second) {
+  global.rate = static_cast<double>(std::max<std::size_t>(1, per_second));
+  global.tokens = std::min(global.tokens, global.rate);
+}
+
+const io::PipelineStats io::RestClient::pipelineStats() const {
+  io::PipelineStats stats = pipeline;
+  for (const std::unique_ptr<io::RestConnection> &conn : pool) {
+    stats.inflight += conn->sent.size();
+    stats.waiting += conn->waiting.size();
+  }
+  return stats;
+}
+
+const io::CoalesceStats& io::RestClient::coalesceStats() const {
+  return coalesce;
+}
+
+void io::RestClient::SetCache(const std::size_t capacity, const long default_ttl) {
+  cache.Configure(capacity, default_ttl);
+  cache_enabled = capacity > 0;
+}
+
+const bool io::RestClient::cacheEnabled() const {
+  return cache_enabled;
+}
+
+void io::RestClient::SetCacheTTL(const std::string &route, const long ms) {
+  cache.SetTTL(route, ms);
+}
+
+void io::RestClient::InvalidateCache(const std::string &id) {
+  if (!cache_enabled) return;
+  service.getService().dispatch([this, id]() {
+    cache.Invalidate(id);
+  });
+}
+
+const io::CacheStats& io::RestClient::cacheStats() const {
+  return cache.cacheStats();
+}
+
+void io::RestClient::SetRetryPolicy(const io::RetryPolicy &policy) {
+  this->policy = policy;
+  this->policy.backoff_base = std::max<long>(1, policy.backoff_base);
+}
+
+const io::RetryPolicy& io::RestClient::retryPolicy() const {
+  return policy;
 }
 
-io::RestRoute::RestRoute() : limited(false) {
+const io::RetryStats& io::RestClient::retryStats() const {
+  return retry;
 }
 
-const bool io::RestRoute::isLimited() const {
-  return limited;
+const bool io::RestResult::ok() const {
+  return error.empty() && ((status >= 200 && status < 300) || status == 304);
 }
 
-const bool io::RestRoute::hasPending() const {
-  return !queued.empty();
+const bool io::RestRequest::idempotent() const {
+  return method == "GET" || method == "HEAD" || method == "PUT"
+    || method == "DELETE" || method == "OPTIONS";
 }
 
-void io::RestRoute::setLimited(bool state) {
-  limited = state;
+const std::size_t io::RestConnection::inflight() const {
+  return sent.size() + waiting.size();
 }
 
-void io::RestRoute::getPending(io::RestRequest &req) {
-  req = std::move(queued.back());
-  queued.pop_back();
+void io::RestClient::SetCompression(const std::size_t threshold, const int level) {
+  compress_threshold = threshold;
+  compress_level = level;
 }
 
-void io::RestRoute::addPending(const io::RestRequest &req) {
-  queued.push_front(std::move(req));
+const io::CompressionStats& io::RestClient::compressionStats() const {
+  return compression;
 }
 
-const std::size_t io::RestRoute::hasLeft() const {
-  return queued.size();
+io::RestConnection& io::RestClient::acquire() {
+  io::RestConnection *least = nullptr;
+  for (const std::unique_ptr<io::RestConnection> &conn : pool) {
+    if (conn->inflight() == 0 && conn->client->isConnected())
+      return *conn;
+    if (least == nullptr || conn->inflight() < least->inflight())
+      least = conn.get();
+  }
+
+  // every connection is busy: open another one while the pool may grow
+  if (least == nullptr || (least->inflight() > 0 && pool.size() < max_connections)) {
+    pool.emplace_back(new io::RestConnection());
+    io::RestConnection &conn = *pool.back();
+    conn.parser.onHeader([this](const io::StringView &key, const io::StringView &value) {
+      std::string name(key);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      if (name.find("set-cookie") != std::string::npos)
+        cookies.push_back(std::string(value.substr(0, value.find(";"))));
+    });
+    _connect(conn);
+    LOG_DEBUG("Rest pool grew to " << pool.size() << " connections");
+    return conn;
+  }
+  return *least;
+}
+
+void io::RestClient::pushRequest(io::RestConnection &conn, const std::string &data,
+  const std::string &route, const bool idempotent, const io::HttpCallback &callback)
+{
+  io::PipelinedRequest req;
+  req.data = data;
+  req.route = route;
+  req.idempotent = idempotent;
+  req.callback = callback;
+  req.serial = ++conn.serial;
+
+  // the deadline runs from here: a request stuck behind a connection that
+  // cannot connect or a full pipeline times out like a written one
+  io::RestConnection *owner = &conn;
+  const std::size_t serial = req.serial;
+  service.spawn(policy.timeout, nullptr, [this, owner, serial](io::Timer *timer) {
+    expire(*owner, serial);
+    delete timer;
+  });
+  conn.waiting.push_back(std::move(req));
+  pump(conn);
+}
+
+void io::RestClient::pump(io::RestConnection &conn) {
+  if (conn.client.get() == nullptr || !conn.client->isConnected()) return;
+
+  io::RestConnection *owner = &conn;
+  while (!conn.waiting.empty() && conn.sent.size() < pipeline.depth) {
+    conn.sent.push_back(std::move(conn.waiting.front()));
+    conn.waiting.pop_front();
+    pipeline.peak = std::max(pipeline.peak, conn.sent.size());
+
+    io::PipelinedRequest &req = conn.sent.back();
+    const std::size_t serial = req.serial;
+    conn.parser.AddCallback(req.route,
+    [this, owner, serial](const std::string &route, const io::Response &resp) {
+      // the request timed out and was failed already, skip its late answer
+      if (owner->sent.empty() || owner->sent.front().serial != serial) return;
+      io::PipelinedRequest done = std::move(owner->sent.front());
+      owner->sent.pop_front();
+      done.callback(route, resp);
+      pump(*owner);
+    });
+    conn.client->Send(req.data.c_str(), req.data.size());
+  }
+}
+
+void io::RestClient::expire(io::RestConnection &conn, const std::size_t serial) {
+  auto matches = [serial](const io::PipelinedRequest &req) { return req.serial == serial; };
+  io::PipelinedRequest expired;
+  auto waiting = std::find_if(conn.waiting.begin(), conn.waiting.end(), matches);
+  auto sent = std::find_if(conn.sent.begin(), conn.sent.end(), matches);
+  if (waiting != conn.waiting.end()) {
+    expired = std::move(*waiting);
+    conn.waiting.erase(waiting);
+  } else if (sent != conn.sent.end()) {
+    expired = std::move(*sent);
+    conn.sent.erase(sent);
+    // every response behind the lost one would wait for it: start over on
+    // a fresh socket, the others are requeued when this one closes. The
+    // peer may be gone, so don't wait for a TLS shutdown it won't answer.
+    conn.client->Abort(io::asio::error::timed_out);
+  } else return;
+
+  retry.timeouts++;
+  LOG_WARN("Request on " << expired.route << " timed out after " << policy.timeout << "ms");
+  io::Response resp;
+  resp.clear();
+  resp.error = "timed out";
+  expired.callback(expired.route, resp);
+}
+
+const bool io::RestBucket::available(const io::Clock::time_point &now) {
+  // the window rolled over: spend the whole limit until a response tells
+  // us the new reset, but never wedge if every response got lost
+  if (now >= reset) {
+    remaining = limit;
+    reset = io::Clock::time_point::max();
+  }
+  if (remaining <= 0 && inflight == 0 && reset == io::Clock::time_point::max())
+    remaining = 1;
+  return remaining > 0;
+}
+
+const bool io::GlobalBucket::take(const io::Clock::time_point &now) {
+  const double elapsed = std::chrono::duration<double>(now - refilled).count();
+  tokens = std::min(rate, tokens + elapsed * rate);
+  refilled = now;
+  if (tokens < 1) return false;
+  tokens -= 1;
+  return true;
+}
+
+const io::Clock::time_point io::GlobalBucket::next() const {
+  const double wait = (1 - tokens) / rate;
+  return refilled + std::chrono::duration_cast<io::Clock::duration>(
+    std::chrono::duration<double>(wait));
 }
 
 void io::RestClient::get(const std::string& endpoint,
@@ -67,146 +245,439 @@ void io::RestClient::del(const std::string& endpoint,
   Request("DELETE", endpoint, data, callback);
 }
 
-void io::RestClient::_connect() {
-  if (client == nullptr)
-    client = std::make_shared<io::SSLClient>(service);
-  else
-    client.reset(new io::SSLClient(service));
+io::Future<io::RestResult> io::RestClient::RequestAsync(const std::string& method,
+  const std::string &endpoint, const io::json &data)
+{
+  io::Promise<io::RestResult> promise;
+  service.getService().dispatch([this, method, endpoint, data, promise]() {
+    _request(method, endpoint, data, [promise](const io::RestResult &result) mutable {
+      promise.resolve(result);
+    });
+  });
+  return promise.future();
+}
+
+io::Future<io::RestResult> io::RestClient::getAsync(const std::string& endpoint, const io::json &data) {
+  return RequestAsync("GET", endpoint, data);
+}
+
+io::Future<io::RestResult> io::RestClient::postAsync(const std::string& endpoint, const io::json &data) {
+  return RequestAsync("POST", endpoint, data);
+}
 
-  client->onRead([this](const std::vector<char> &data) {
-    parser.Feed(data);
+io::Future<io::RestResult> io::RestClient::delAsync(const std::string& endpoint, const io::json &data) {
+  return RequestAsync("DELETE", endpoint, data);
+}
+
+void io::RestClient::_connect(io::RestConnection &conn) {
+  io::RestConnection *owner = &conn;
+  conn.client = std::make_shared<io::SSLClient>(service);
+
+  conn.client->onRead([owner](const char *data, const std::size_t len) {
+    owner->parser.Feed(data, len);
+    return len;
   });
 
-  client->onConnect([&](const io::error_code &err) {
+  conn.client->onConnect([this, owner](const io::error_code &err) {
     if (err) {
-      std::cerr << "[Valk] Failed to connect: " << err.message() << std::endl;
+      LOG_ERROR("Failed to connect: " << err.message() << ", retrying");
+      service.spawn(1000, nullptr, [this, owner](io::Timer *timer) {
+        _connect(*owner);
+        delete timer;
+      });
       return;
     }
-    if (!writes.empty()) {
-      std::string data;
-      while (!writes.empty()) {
-        data = std::move(writes.back());
-        writes.pop_back();
-        pushRequest(data);
+    pump(*owner);
+  });
+
+  conn.client->onClose([this, owner](const io::error_code &err) {
+    // idempotent requests written but not answered go out again, ahead of
+    // the ones still waiting and in the same order. The others may have
+    // been carried out already, so they fail like a lost response instead.
+    owner->parser.Reset();
+    if (!owner->sent.empty())
+      LOG_WARN("Rest client closed with " << owner->sent.size()
+        << " requests in flight, requeueing");
+    std::deque<io::PipelinedRequest> dropped;
+    while (!owner->sent.empty()) {
+      io::PipelinedRequest &req = owner->sent.back();
+      if (req.idempotent && req.replays < policy.max_retries) {
+        req.replays++;
+        pipeline.requeued++;
+        owner->waiting.push_front(std::move(req));
+      } else {
+        dropped.push_front(std::move(req));
       }
+      owner->sent.pop_back();
     }
-  });
 
-  client->onClose([&](const io::error_code &err) {
-    std::cout << "Client closed: " << err.message() << std::endl;
-    std::cout << "Respawning..." << std::endl;
-    service.getService().post([this]() {
-      _connect();
+    LOG_WARN("Rest client closed: " << err.message() << ", reconnecting");
+    service.getService().post([this, owner]() {
+      _connect(*owner);
     });
+
+    io::Response resp;
+    resp.clear();
+    resp.error = "connection closed";
+    for (io::PipelinedRequest &req : dropped)
+      req.callback(req.route, resp);
   });
 
-  client->Connect(valk::BASE_HOST, 443);
+  conn.client->Connect(valk::BASE_HOST, 443);
 }
 
 void io::RestClient::Request(const std::string& method,
   const std::string &endpoint, const io::json &data, const io::RestCallback &callback)
 {
-  std::ostringstream request;
+  // requests may come from shard threads: run them on the rest loop,
+  // inline when already there. Callbacks always run on the rest loop.
+  service.getService().dispatch([this, method, endpoint, data, callback]() {
+    _request(method, endpoint, data, [callback](const io::RestResult &result) {
+      callback(result.data);
+    });
+  });
+}
+
+static bool IsSnowflake(const std::string &segment) {
+  return !segment.empty() &&
+    std::all_of(segment.begin(), segment.end(), ::isdigit);
+}
 
-  std::size_t rend = endpoint.substr(1).find("/");
-  rend = rend == std::string::npos ? endpoint.size() : rend + 1;
-  std::string route_str = method + ";" + endpoint.substr(0, rend);
-  if (routes.find(route_str) == routes.end()) {
-    io::RestRoute route;
-    routes.insert(std::make_pair(route_str, std::move(route)));
+// "GET /channels/1/messages/2" -> "GET /channels/1/messages/:id":
+// the major parameter of channels, guilds and webhooks stays, other ids
+// and reaction emoji are folded so they share their route's bucket
+static std::string RouteKey(const std::string &method, const std::string &endpoint) {
+  std::string segment, key = method + " ";
+  std::istringstream path(endpoint.substr(0, endpoint.find('?')));
+  std::vector<std::string> parts;
+  while (std::getline(path, segment, '/'))
+    if (!segment.empty()) parts.push_back(segment);
+
+  const bool major = !parts.empty() && (parts[0] == "channels"
+    || parts[0] == "guilds" || parts[0] == "webhooks");
+  for (std::size_t i = 0; i < parts.size(); i++) {
+    key += "/";
+    if (i == 1 && major) key += parts[i];
+    else if (i == 2 && parts[0] == "webhooks") key += parts[i];
+    else if (i > 0 && parts[i - 1] == "reactions") key += ":emoji";
+    else if (IsSnowflake(parts[i])) key += ":id";
+    else key += parts[i];
   }
+  return key;
+}
+
+// the part of a route key identifying its major parameter
+static std::string MajorOf(const std::string &route) {
+  std::size_t pos = route.find('/');
+  for (int i = 0; i < 2 && pos != std::string::npos; i++)
+    pos = route.find('/', pos + 1);
+  const std::size_t start = route.find('/');
+  return route.substr(start, pos == std::string::npos ? std::string::npos : pos - start);
+}
+
+static long HeaderLong(const io::Response &resp, const io::StringView &name, long fallback) {
+  if (!resp.hasHeader(name)) return fallback;
+  return std::strtol(std::string(resp.header(name)).c_str(), nullptr, 10);
+}
+
+static io::Clock::duration HeaderSeconds(const io::Response &resp, const io::StringView &name) {
+  const double secs = std::strtod(std::string(resp.header(name)).c_str(), nullptr);
+  return std::chrono::duration_cast<io::Clock::duration>(
+    std::chrono::duration<double>(secs));
+}
+
+std::string io::RestClient::bucketKey(const std::string &route) {
+  auto it = route_buckets.find(route);
+  return it == route_buckets.end() ? route : it->second;
+}
 
-  request << method << " " << valk::BASE_ENDPOINT << endpoint << " HTTP/1.1\r\n"
+std::string io::RestClient::buildRequest(io::RestConnection &conn, const io::RestRequest &req) {
+  std::ostringstream request;
+  request << req.method << " " << valk::BASE_ENDPOINT << req.endpoint << " HTTP/1.1\r\n"
       << "Host: " << valk::BASE_HOST << ":443\r\n"
       << "Authorization: Bot " << token << "\r\n"
       << "User-Agent: DisocrdBot (" << valk::LIBNAME
         << ", " << valk::VERSION_STRING << ")\r\n"
-      << "Accept: */*\r\n" 
+      << "Accept: */*\r\n"
       << "Accept-Encoding: gzip\r\n"
+      << "X-RateLimit-Precision: millisecond\r\n"
       << "Connection: keep-alive\r\n";
+  if (!req.etag.empty())
+    request << "If-None-Match: " << req.etag << "\r\n";
   if (cookies.size() > 0) {
     request << "Cookie: ";
     for (std::size_t i = 0; i < cookies.size(); i++)
       request << cookies[i] << (i == cookies.size() - 1 ? "" : "; ");
     request << "\r\n";
   }
-  std::string json_data = data.dump();
-  if (json_data.size() > 4) {
-    std::cout << "Encoding: " << json_data << std::endl;
-    json_data = parser.gzip(json_data);
-    request << "Content-Encoding: gzip\r\n"
-        << "Content-Length: " << json_data.size() << "\r\n"
-        << "Content-Type: application/json; charset=UTF-8\r\n"
-        << json_data;
-  } else request << "\r\n";
+  const std::string json_data = req.data.dump();
+  if (json_data.size() <= 4 && (req.method == "GET" || req.method == "DELETE")) {
+    request << "\r\n";
+    return request.str();
+  }
+
+  LOG_TRACE("Encoding: " << json_data);
+  compression.requests++;
+  request << "Content-Type: application/json; charset=UTF-8\r\n";
+  if (compress_level != Z_NO_COMPRESSION && json_data.size() >= compress_threshold) {
+    const auto start = io::Clock::now();
+    conn.deflater.setLevel(compress_level);
+    const std::string &body = conn.deflater.Compress(json_data.data(), json_data.size());
+    const std::size_t micros = static_cast<std::size_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(io::Clock::now() - start).count());
+    compression.micros += micros;
+    LOG_DEBUG("Compressed " << req.route << " body " << json_data.size()
+      << " -> " << body.size() << " bytes in " << micros << "us");
+
+    if (body.size() < json_data.size()) {
+      compression.compressed++;
+      compression.bytes_in += json_data.size();
+      compression.bytes_out += body.size();
+      request << "Content-Encoding: gzip\r\n"
+          << "Content-Length: " << body.size() << "\r\n\r\n";
+      request.write(body.data(), body.size());
+      return request.str();
+    }
+  }
+
+  compression.bytes_in += json_data.size();
+  compression.bytes_out += json_data.size();
+  request << "Content-Length: " << json_data.size() << "\r\n\r\n" << json_data;
+  return request.str();
+}
 
+void io::RestClient::_request(const std::string& method,
+  const std::string &endpoint, const io::json &data, const io::RestResultCallback &callback)
+{
   io::RestRequest req;
-  req.data = std::move(data);
-  req.method = std::move(method);
-  req.endpoint = std::move(endpoint);
-  req.callback = std::move(callback);
+  req.data = data;
+  req.method = method;
+  req.endpoint = endpoint;
+  req.callback = callback;
+  req.route = RouteKey(method, endpoint);
+
+  // a GET matching one still in flight waits for that response instead
+  if (method == "GET") {
+    const std::string id = endpoint + " " + data.dump();
+    if (cache.enabled()) {
+      const io::CachedResponse *entry = cache.find(id, io::Clock::now());
+      if (entry != nullptr && entry->expires > io::Clock::now()) {
+        io::RestResult cached;
+        cached.status = 200;
+        cached.data = entry->data;
+        callback(cached);
+        return;
+      }
+      if (entry != nullptr) req.etag = entry->etag;
+      req.cache_key = id;
+    }
+
+    coalesce.gets++;
+    auto it = coalesced.find(id);
+    if (it != coalesced.end()) {
+      coalesce.hits++;
+      it->second.push_back(callback);
+      LOG_TRACE("Coalesced GET " << endpoint);
+      return;
+    }
+    coalesced[id].push_back(callback);
+    req.callback = [this, id](const io::RestResult &result) {
+      std::vector<io::RestResultCallback> waiting = std::move(coalesced[id]);
+      coalesced.erase(id);
+      for (const io::RestResultCallback &cb : waiting)
+        cb(result);
+    };
+  } else if (cache.enabled()) {
+    cache.InvalidatePath(endpoint);
+  }
+
+  const std::string key = bucketKey(req.route);
+  buckets[key].queued.push_back(std::move(req));
+  drain(key);
+}
 
-  if (globalRoute.isLimited()) {
-    globalRoute.addPending(std::move(req));
+void io::RestClient::schedule(const std::string &key, const io::Clock::time_point &when) {
+  io::RestBucket &bucket = buckets[key];
+  if (bucket.timer_pending) return;
+  bucket.timer_pending = true;
+  const long delay = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+    when - io::Clock::now()).count());
+  service.spawn(std::max<long>(delay, 0) + 1, nullptr, [this, key](io::Timer *timer) {
+    buckets[key].timer_pending = false;
+    drain(key);
+    delete timer;
+  });
+}
+
+void io::RestClient::drain(const std::string &key) {
+  io::RestBucket &bucket = buckets[key];
+  const io::Clock::time_point now = io::Clock::now();
+  if (bucket.queued.empty()) return;
+  if (global_reset > now) {
+    schedule(key, global_reset);
     return;
   }
-  routes[route_str].addPending(std::move(req));
-  bool limited = routes[route_str].isLimited();
-  if (limited) return;
-
-  parser.AddCallback(route_str, [this](const std::string &route, const io::Response &resp) {
-    io::json data = io::json::parse(resp.body);
-    io::RestRequest rreq;
-    routes[route].getPending(rreq);
-
-    if (resp.headers.find("X-RateLimit-Remaining") != resp.headers.end()) {
-      if (std::stoi(resp.headers.at("X-RateLimit-Remaining"), nullptr, 10) < 1) {
-        long wait_time;
-        if (resp.headers.find("X-RateLimit-Reset") != resp.headers.end()) {
-          const long now = static_cast<long>(std::time(nullptr));
-          long reset = std::stol(resp.headers.at("X-RateLimit-Reset"), nullptr, 10);
-          wait_time = (reset - now) * 1000;
-        } else if (resp.headers.find("Retry-After") != resp.headers.end()) {
-          wait_time = std::stol(resp.headers.at("Retry-After"), nullptr, 10);
-        }
-
-        if (data.find("global") != data.end()) {
-          std::string global = data["global"];
-          if (global == "true") {
-            globalRoute.setLimited(true);
-            service.spawn(wait_time, nullptr, [this](io::Timer *task) {
-              io::RestRequest request;
-              globalRoute.setLimited(false);
-              const std::size_t remaining = globalRoute.hasLeft();
-              for (std::size_t i = 0; i < remaining; i++) {
-                globalRoute.getPending(request);
-                Request(request.method, request.endpoint,
-                  request.data, request.callback);
-              }
-            });
-          }
-        }
-
-        routes[route].setLimited(true);
-        service.spawn(wait_time, new std::string(route), [this](io::Timer *task) {
-          std::string *route_str = static_cast<std::string*>(task->data);
-          io::RestRequest request;
-
-          this->routes[*route_str].setLimited(false);
-          const std::size_t remaining = this->routes[*route_str].hasLeft();
-          for (std::size_t i = 0; i < remaining; i++) {
-            this->routes[*route_str].getPending(request);
-            this->Request(request.method, request.endpoint,
-              request.data, request.callback);
-          }
-          
-          delete route_str;
-          delete task;
-        });
-      }
+  if (bucket.open_until > now) {
+    std::deque<io::RestRequest> rejected = std::move(bucket.queued);
+    bucket.queued.clear();
+    for (io::RestRequest &req : rejected)
+      fail(req, "circuit open");
+    return;
+  }
+
+  while (!bucket.queued.empty() && bucket.available(now)) {
+    // half open after a trip: one probe at a time until it succeeds
+    if (bucket.failures >= policy.breaker_threshold && bucket.inflight > 0) break;
+    if (!global.take(now)) {
+      schedule(key, global.next());
+      return;
     }
-    rreq.callback(data);
+    io::RestRequest req = std::move(bucket.queued.front());
+    bucket.queued.pop_front();
+    bucket.remaining--;
+    bucket.inflight++;
+    send(key, std::move(req));
+  }
+
+  if (!bucket.queued.empty() && bucket.reset != io::Clock::time_point::max())
+    schedule(key, bucket.reset);
+}
+
+void io::RestClient::send(const std::string &key, io::RestRequest &&req) {
+  std::shared_ptr<io::RestRequest> pending =
+    std::make_shared<io::RestRequest>(std::move(req));
+  io::RestConnection &conn = acquire();
+  pushRequest(conn, buildRequest(conn, *pending), pending->route, pending->idempotent(),
+  [this, key, pending](const std::string &route, const io::Response &resp) {
+    onResponse(key, *pending, resp);
   });
-  
-  pushRequest(request.str());
-}
\ No newline at end of file
+}
+
+void io::RestClient::fail(io::RestRequest &req, const char *reason, const int status) {
+  retry.failed++;
+  LOG_WARN("Giving up on " << req.route << ": " << reason);
+  io::RestResult result;
+  result.status = status;
+  result.error = reason;
+  req.callback(result);
+}
+
+// counts the outcome against the bucket's breaker and, for a failure that
+// may be repeated safely, schedules the retry
+const bool io::RestClient::retryable(const std::string &key,
+  io::RestRequest &req, const io::Response &resp)
+{
+  io::RestBucket &bucket = buckets[key];
+  if (resp.error.empty() && resp.status < 500) {
+    bucket.failures = 0;
+    return false;
+  }
+
+  const io::Clock::time_point now = io::Clock::now();
+  if (++bucket.failures >= policy.breaker_threshold && bucket.open_until <= now) {
+    retry.breaker_trips++;
+    bucket.open_until = now + std::chrono::milliseconds(policy.breaker_cooldown);
+    LOG_WARN("Circuit open on " << key << " after " << bucket.failures << " failures");
+  }
+  if (!req.idempotent() || req.attempts >= policy.max_retries || bucket.open_until > now)
+    return false;
+
+  // equal jitter: half the doubled backoff, plus up to the other half
+  const long backoff = std::min(policy.backoff_cap,
+    policy.backoff_base << std::min<std::size_t>(req.attempts, 20));
+  const long delay = backoff / 2 +
+    std::uniform_int_distribution<long>(0, backoff / 2)(Random);
+  req.attempts++;
+  retry.retries++;
+  LOG_DEBUG("Retrying " << req.route << " in " << delay << "ms (status "
+    << resp.status << ", attempt " << req.attempts << ")");
+
+  std::shared_ptr<io::RestRequest> again =
+    std::make_shared<io::RestRequest>(std::move(req));
+  service.spawn(delay, nullptr, [this, key, again](io::Timer *timer) {
+    buckets[key].queued.push_front(std::move(*again));
+    drain(key);
+    delete timer;
+  });
+  return true;
+}
+
+void io::RestClient::onResponse
+(const std::string &sent_key, io::RestRequest &req, const io::Response &resp)
+{
+  const io::Clock::time_point now = io::Clock::now();
+  io::RestBucket &sent = buckets[sent_key];
+  if (sent.inflight > 0) sent.inflight--;
+
+  // learn which bucket the route really belongs to and move its queue there
+  std::string key = sent_key;
+  if (resp.hasHeader("X-RateLimit-Bucket")) {
+    key = std::string(resp.header("X-RateLimit-Bucket")) + " " + MajorOf(req.route);
+    if (route_buckets[req.route] != key) {
+      route_buckets[req.route] = key;
+      io::RestBucket &old = buckets[req.route];
+      io::RestBucket &learned = buckets[key];
+      while (!old.queued.empty()) {
+        learned.queued.push_back(std::move(old.queued.front()));
+        old.queued.pop_front();
+      }
+    }
+  }
+
+  io::RestBucket &bucket = buckets[key];
+  if (resp.hasHeader("X-RateLimit-Remaining")) {
+    bucket.limit = HeaderLong(resp, "X-RateLimit-Limit", bucket.limit);
+    bucket.remaining = HeaderLong(resp, "X-RateLimit-Remaining", 0) - bucket.inflight;
+    if (resp.hasHeader("X-RateLimit-Reset-After"))
+      bucket.reset = now + HeaderSeconds(resp, "X-RateLimit-Reset-After");
+  }
+
+  if (resp.status == 429) {
+    const io::Clock::time_point retry = resp.hasHeader("Retry-After") ?
+      now + HeaderSeconds(resp, "Retry-After") : now + std::chrono::seconds(1);
+    if (resp.header("X-RateLimit-Global") == "true") {
+      LOG_WARN("Hit the global rate limit");
+      global_reset = retry;
+    } else {
+      LOG_WARN("Rate limited on " << req.route);
+      bucket.remaining = 0;
+      bucket.reset = retry;
+    }
+    bucket.queued.push_front(std::move(req));
+    drain(key);
+    return;
+  }
+
+  const bool retrying = retryable(key, req, resp);
+  if (retrying || !resp.error.empty()) {
+    if (!retrying) fail(req, resp.error.c_str(), resp.status);
+    drain(key);
+    if (key != sent_key) drain(sent_key);
+    return;
+  }
+
+  io::RestResult result;
+  result.status = resp.status;
+  if (resp.status == 304 && !req.cache_key.empty()) {
+    const io::json *cached = cache.Revalidate(req.cache_key);
+    if (cached != nullptr) result.data = *cached;
+    else {
+      LOG_WARN("Not modified response for evicted " << req.endpoint);
+      result.error = "not modified, cache entry evicted";
+    }
+  } else {
+    try {
+      if (!resp.body.empty()) result.data = io::json::parse(resp.body);
+    } catch (const std::exception &ex) {
+      LOG_ERROR("Bad response body on " << req.route << ": " << ex.what());
+      result.error = std::string("bad response body: ") + ex.what();
+    }
+    if (result.error.empty() && !req.cache_key.empty() &&
+        resp.status >= 200 && resp.status < 300)
+      cache.Store(req.cache_key, req.endpoint, result.data, std::string(resp.header("ETag")));
+  }
+  req.callback(result);
+
+  drain(key);
+  if (key != sent_key) drain(sent_key);
+}
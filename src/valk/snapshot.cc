@@ -0,0 +1,205 @@
+#include "snapshot.hh"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+namespace {
+
+  class Writer {
+  public:
+    std::string out;
+
+    inline void u8(const uint8_t value) {
+      out.push_back(static_cast<char>(value));
+    }
+
+    // little endian base 128, so small counts and ints take one byte
+    inline void uint(uint64_t value) {
+      while (value >= 0x80) {
+        u8(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+      }
+      u8(static_cast<uint8_t>(value));
+    }
+
+    inline void sint(const int64_t value) {
+      uint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+
+    inline void str(const std::string &value) {
+      uint(value.size());
+      out.append(value);
+    }
+
+    void user(const valk::User &user) {
+      uint(user.id);
+      u8((user.bot ? 1 : 0) | (user.verified ? 2 : 0) | (user.mfa_enabled ? 4 : 0));
+      str(user.email);
+      str(user.avatar);
+      str(user.discrim);
+      str(user.username);
+    }
+
+    void guild(const valk::Guild &guild) {
+      uint(guild.id);
+      u8((guild.large ? 1 : 0) | (guild.unavailable ? 2 : 0));
+      str(guild.name);
+      str(guild.icon);
+      str(guild.splash);
+      str(guild.region);
+      sint(guild.mfa_level);
+      sint(guild.afk_timeout);
+      sint(guild.verify_level);
+      sint(guild.member_count);
+      sint(guild.default_notify);
+      sint(guild.explicit_filter);
+    }
+  };
+
+  class Reader {
+  private:
+    const std::string &in;
+    std::size_t offset;
+
+  public:
+    bool ok;
+
+    Reader(const std::string &data) : in(data), offset(0), ok(true) {}
+
+    inline uint8_t u8() {
+      if (offset >= in.size()) {
+        ok = false;
+        return 0;
+      }
+      return static_cast<uint8_t>(in[offset++]);
+    }
+
+    inline uint64_t uint() {
+      uint64_t value = 0;
+      for (int shift = 0; ok && shift < 64; shift += 7) {
+        const uint8_t byte = u8();
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+      }
+      return value;
+    }
+
+    inline int64_t sint() {
+      const uint64_t value = uint();
+      return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // every entry takes at least one byte, which bounds corrupt counts
+    inline std::size_t count() {
+      const uint64_t value = uint();
+      if (!ok || value > in.size() - offset) {
+        ok = false;
+        return 0;
+      }
+      return static_cast<std::size_t>(value);
+    }
+
+    inline std::string str() {
+      const uint64_t len = uint();
+      if (!ok || in.size() - offset < len) {
+        ok = false;
+        return std::string();
+      }
+      std::string value = in.substr(offset, len);
+      offset += len;
+      return value;
+    }
+
+    void user(valk::User &user) {
+      user.id = uint();
+      const uint8_t flags = u8();
+      user.bot = (flags & 1) != 0;
+      user.verified = (flags & 2) != 0;
+      user.mfa_enabled = (flags & 4) != 0;
+      user.email = str();
+      user.avatar = str();
+      user.discrim = str();
+      user.username = str();
+    }
+
+    void guild(valk::Guild &guild) {
+      guild.id = uint();
+      const uint8_t flags = u8();
+      guild.large = (flags & 1) != 0;
+      guild.unavailable = (flags & 2) != 0;
+      guild.name = str();
+      guild.icon = str();
+      guild.splash = str();
+      guild.region = str();
+      guild.mfa_level = static_cast<int>(sint());
+      guild.afk_timeout = static_cast<int>(sint());
+      guild.verify_level = static_cast<int>(sint());
+      guild.member_count = static_cast<int>(sint());
+      guild.default_notify = static_cast<int>(sint());
+      guild.explicit_filter = static_cast<int>(sint());
+    }
+  };
+
+}
+
+bool valk::Snapshot::Write(const std::string &path) const {
+  Writer writer;
+  writer.uint(MAGIC);
+  writer.u8(VERSION);
+  writer.uint(static_cast<uint64_t>(saved));
+  writer.uint(shard_count);
+
+  writer.uint(sessions.size());
+  for (const valk::ShardSession &session : sessions) {
+    writer.uint(session.shard_id);
+    writer.uint(session.seq);
+    writer.str(session.session_id);
+  }
+  writer.uint(users.size());
+  for (const valk::User &user : users)
+    writer.user(user);
+  writer.uint(guilds.size());
+  for (const valk::Guild &guild : guilds)
+    writer.guild(guild);
+
+  // write beside the target and rename, so a crash never leaves half a snapshot
+  const std::string temp = path + ".tmp";
+  {
+    std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+    file.write(writer.out.data(), writer.out.size());
+    if (!file) return false;
+  }
+  return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+bool valk::Snapshot::Read(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) return false;
+  const std::string data((std::istreambuf_iterator<char>(file)),
+    std::istreambuf_iterator<char>());
+
+  Reader reader(data);
+  if (reader.uint() != MAGIC || reader.u8() != VERSION) return false;
+  saved = static_cast<std::time_t>(reader.uint());
+  shard_count = reader.uint();
+
+  sessions.resize(reader.count());
+  for (valk::ShardSession &session : sessions) {
+    if (!reader.ok) return false;
+    session.shard_id = reader.uint();
+    session.seq = reader.uint();
+    session.session_id = reader.str();
+  }
+  users.resize(reader.count());
+  for (valk::User &user : users) {
+    if (!reader.ok) return false;
+    reader.user(user);
+  }
+  guilds.resize(reader.count());
+  for (valk::Guild &guild : guilds) {
+    if (!reader.ok) return false;
+    reader.guild(guild);
+  }
+  return reader.ok;
+}
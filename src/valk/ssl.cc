@@ -1,11 +1,21 @@
 #include "io/ssl.hh"
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <cstring>
 
 void io::Service::Run() {
   loop->run();
 }
 
+void io::Service::Hold() {
+  if (work.get() == nullptr)
+    work = std::make_shared<io::asio::io_service::work>(getService());
+}
+
+void io::Service::Release() {
+  work.reset();
+}
+
 io::ssl::context& io::Service::getContext() {
   return *(ssl_ctx.get());
 }
@@ -14,10 +24,41 @@ io::asio::io_service& io::Service::getService() {
   return *(loop.get());
 }
 
+io::SlabPool& io::Service::getSlabs() {
+  return *(slabs.get());
+}
+
+// One context for every Service, so a session one loop's connection got
+// from a host resumes the next connection to it on any loop.
+class SharedTls {
+public:
+  std::shared_ptr<io::ssl::context> ctx;
+  io::SessionCache sessions;
+  io::HandshakeStats stats;
+
+  SharedTls() : ctx(std::make_shared<io::ssl::context>(io::ssl::context::sslv23)) {
+    sessions.Attach(*ctx);
+  }
+};
+
+static SharedTls& Tls() {
+  static SharedTls tls;
+  return tls;
+}
+
+io::SessionCache& io::Service::getSessions() {
+  return Tls().sessions;
+}
+
+io::HandshakeStats& io::Service::handshakeStats() {
+  return Tls().stats;
+}
+
 io::Service::Service() {
+  slabs = std::make_shared<io::SlabPool>();
   loop = std::make_shared<io::asio::io_service>();
   resolver = std::make_shared<io::tcp::resolver>(getService());
-  ssl_ctx = std::make_shared<io::ssl::context>(io::ssl::context::sslv23);
+  ssl_ctx = Tls().ctx;
 }
 
 void io::Service::Resolve(const std::string &host, int port,
@@ -43,6 +84,100 @@ io::Timer* io::Service::spawn
 
 ////////////////////////////////////////////////////////////////////////
 
+// asio keeps its verify callback in the context's app data
+static int CacheIndex() {
+  static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+static int NewSession(SSL *ssl, SSL_SESSION *session) {
+  const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (host == nullptr) return 0;
+  io::SessionCache *cache = static_cast<io::SessionCache*>(
+    SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), CacheIndex()));
+  cache->Store(host, session);
+  // the cache keeps the reference OpenSSL handed us
+  return 1;
+}
+
+io::SessionCache::~SessionCache() {
+  for (auto &entry : sessions)
+    SSL_SESSION_free(entry.second);
+}
+
+void io::SessionCache::Attach(io::ssl::context &ctx) {
+  SSL_CTX *native = ctx.native_handle();
+  SSL_CTX_set_ex_data(native, CacheIndex(), this);
+  SSL_CTX_set_session_cache_mode(native,
+    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(native, NewSession);
+}
+
+void io::SessionCache::Store(const std::string &host, SSL_SESSION *session) {
+  std::lock_guard<std::mutex> guard(lock);
+  SSL_SESSION *&slot = sessions[host];
+  if (slot != nullptr) SSL_SESSION_free(slot);
+  slot = session;
+}
+
+void io::SessionCache::Offer(const std::string &host, SSL *ssl) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = sessions.find(host);
+  if (it != sessions.end()) SSL_set_session(ssl, it->second);
+}
+
+void io::SessionCache::Forget(const std::string &host) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = sessions.find(host);
+  if (it == sessions.end()) return;
+  SSL_SESSION_free(it->second);
+  sessions.erase(it);
+}
+
+////////////////////////////////////////////////////////////////////////
+
+const std::size_t io::SlabPool::MIN_SLAB;
+const std::size_t io::SlabPool::MAX_SLAB;
+const std::size_t io::SlabPool::KEEP;
+
+io::SlabPool::SlabPool() : free(classOf(MAX_SLAB) + 1) {
+}
+
+std::size_t io::SlabPool::classOf(const std::size_t size) {
+  std::size_t index = 0;
+  while ((MIN_SLAB << index) < size && (MIN_SLAB << index) < MAX_SLAB)
+    index++;
+  return index;
+}
+
+io::Slab io::SlabPool::acquire(const std::size_t size) {
+  const std::size_t index = classOf(size);
+  io::Slab slab;
+  slab.size = MIN_SLAB << index;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!free[index].empty()) {
+      slab.data = std::move(free[index].back());
+      free[index].pop_back();
+      return slab;
+    }
+  }
+  slab.data.reset(new char[slab.size]);
+  return slab;
+}
+
+void io::SlabPool::release(io::Slab &slab) {
+  if (slab.data.get() == nullptr) return;
+  const std::size_t index = classOf(slab.size);
+  std::lock_guard<std::mutex> guard(lock);
+  if (free[index].size() < KEEP)
+    free[index].push_back(std::move(slab.data));
+  slab.data.reset();
+  slab.size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+
 io::Timer::Timer(io::asio::io_service &service) : timer(service), data(nullptr) {
 }
 
@@ -61,13 +196,37 @@ void io::Timer::async(const long ms, const std::function<void(Timer*)> &callback
 ////////////////////////////////////////////////////////////////////////
 
 io::SSLClient::SSLClient(io::Service& loop) : service(loop) {
+  newStream();
+
+  on_close = [](const io::error_code& err){};
+  on_connect = [](const io::error_code& err){};
+  on_read = [](const char *data, const std::size_t len) { return len; };
+}
+
+io::SSLClient::~SSLClient() {
+  service.getSlabs().release(slab);
+}
+
+void io::SSLClient::newStream() {
   sock = std::make_shared<io::ssl::stream<io::tcp::socket>>(
     service.getService(), service.getContext());
   sock->set_verify_mode(io::ssl::verify_none);
+}
 
-  on_close = [](const io::error_code& err){};
-  on_connect = [](const io::error_code& err){};
-  on_read = [](const std::vector<char>& data){};
+void io::SSLClient::SetReadCap(const std::size_t cap) {
+  read_cap = std::max(io::SlabPool::MIN_SLAB, std::min(cap, io::SlabPool::MAX_SLAB));
+}
+
+const std::size_t io::SSLClient::readSize() const {
+  return slab.size;
+}
+
+const long io::SSLClient::handshakeMicros() const {
+  return handshake_micros;
+}
+
+const bool io::SSLClient::isResumed() const {
+  return SSL_session_reused(sock->native_handle()) == 1;
 }
 
 const bool io::SSLClient::isConnected() const {
@@ -82,14 +241,97 @@ void io::SSLClient::onConnect(std::function<void(const io::error_code&)> cb) {
   on_connect = cb;
 }
 
-void io::SSLClient::onRead(std::function<void(const std::vector<char>&)> cb) {
+void io::SSLClient::onRead(const io::ReadCallback &cb) {
   on_read = cb;
 }
 
+const std::size_t io::SSLClient::queueBytes() const {
+  return queued_bytes;
+}
+
+const std::size_t io::SSLClient::queueLength() const {
+  return writes.size();
+}
+
 void io::SSLClient::Send(const char* data, const std::size_t len) {
   if (!connected) return;
-  io::asio::async_write(*(sock.get()), io::asio::buffer(data, len),
-    [this](const io::error_code& e, std::size_t written) { if (e) Close(e); });
+  writes.emplace_back();
+  io::PendingWrite &write = writes.back();
+  write.owned.assign(data, len);
+  write.head = io::asio::buffer(write.owned);
+  queued_bytes += len;
+  flush();
+}
+
+void io::SSLClient::Send(const io::asio::const_buffer &head,
+  const io::asio::const_buffer &body, const io::WriteCallback &done)
+{
+  if (!connected) {
+    done(io::asio::error::not_connected);
+    return;
+  }
+  writes.emplace_back();
+  io::PendingWrite &write = writes.back();
+  write.head = head;
+  write.body = body;
+  write.done = done;
+  queued_bytes += head.size() + body.size();
+  flush();
+}
+
+// The ssl stream hands only the first buffer of a sequence to each
+// SSL_write, so a gather write would still cost one record per buffer.
+// The batch is copied into one reused buffer instead and goes out in
+// as few records as its size allows.
+void io::SSLClient::flush() {
+  if (writing || writes.empty() || !connected) return;
+
+  outgoing.clear();
+  in_flight = 0;
+  for (const io::PendingWrite &write : writes) {
+    const std::size_t size = write.head.size() + write.body.size();
+    if (in_flight > 0 && outgoing.size() + size > MAX_BATCH) break;
+    const char *head = static_cast<const char*>(write.head.data());
+    const char *body = static_cast<const char*>(write.body.data());
+    outgoing.insert(outgoing.end(), head, head + write.head.size());
+    outgoing.insert(outgoing.end(), body, body + write.body.size());
+    in_flight++;
+  }
+
+  writing = true;
+  io::asio::async_write(*(sock.get()), io::asio::buffer(outgoing),
+    boost::bind(&io::SSLClient::_write_handler, this,
+      io::asio::placeholders::error,
+      io::asio::placeholders::bytes_transferred));
+}
+
+void io::SSLClient::_write_handler(const io::error_code& err, std::size_t size) {
+  writing = false;
+  // don't let one huge message pin its buffer forever
+  if (outgoing.capacity() > MAX_KEPT)
+    std::vector<char>().swap(outgoing);
+  while (in_flight > 0) {
+    io::PendingWrite write = std::move(writes.front());
+    writes.pop_front();
+    in_flight--;
+    queued_bytes -= write.head.size() + write.body.size();
+    if (write.done) write.done(err);
+  }
+
+  if (err) Close(err);
+  else flush();
+}
+
+void io::SSLClient::failWrites(const io::error_code& err) {
+  // the write in flight is answered by its own handler
+  std::deque<io::PendingWrite> dropped(
+    std::make_move_iterator(writes.begin() + in_flight),
+    std::make_move_iterator(writes.end()));
+  writes.erase(writes.begin() + in_flight, writes.end());
+  for (io::PendingWrite &write : dropped) {
+    queued_bytes -= write.head.size() + write.body.size();
+    if (write.done) write.done(err);
+  }
 }
 
 void io::SSLClient::_connect(const io::tcp::endpoint& endpoint,
@@ -104,15 +346,36 @@ void io::SSLClient::Close(const io::error_code& err, bool callback) {
   if (!connected) return;
   io::error_code ec;
   connected = false;
+  failWrites(err ? err : io::asio::error::operation_aborted);
   sock->lowest_layer().cancel(ec);
-  sock->async_shutdown([&](const io::error_code &error) {
+  shutting_down = true;
+  sock->async_shutdown([this, err, ec, callback](const io::error_code &error) {
     io::error_code e;
+    shutting_down = false;
     sock->lowest_layer().close(e);
     if (callback)
       on_close(e ? e : (err ? err : ec));
+    if (after_shutdown) {
+      std::function<void()> next = std::move(after_shutdown);
+      after_shutdown = nullptr;
+      next();
+    }
   });
 }
 
+void io::SSLClient::Abort(const io::error_code& err) {
+  io::error_code ec;
+  if (connected) {
+    connected = false;
+    failWrites(err);
+    sock->lowest_layer().close(ec);
+    service.getService().post([this, err]() { on_close(err); });
+  } else if (shutting_down) {
+    // the pending shutdown fails now and reports the close itself
+    sock->lowest_layer().close(ec);
+  }
+}
+
 void io::SSLClient::_connect_handler(const io::error_code& err,
   io::tcp::resolver::iterator it, std::function<void(const io::error_code&)> callback)
 {
@@ -126,40 +389,122 @@ void io::SSLClient::_connect_handler(const io::error_code& err,
   }
 }
 
+// moves the unconsumed bytes into a slab of `size`
+void io::SSLClient::resize(const std::size_t size) {
+  io::Slab next = service.getSlabs().acquire(size);
+  if (read_end > read_start)
+    std::memcpy(next.data.get(), slab.data.get() + read_start, read_end - read_start);
+  read_end -= read_start;
+  read_start = 0;
+  service.getSlabs().release(slab);
+  slab = std::move(next);
+}
+
+void io::SSLClient::startRead() {
+  if (slab.data.get() == nullptr) {
+    slab = service.getSlabs().acquire(io::SlabPool::MIN_SLAB);
+    read_start = read_end = 0;
+  }
+  if (read_end == slab.size) {
+    if (read_start > 0) {
+      std::memmove(slab.data.get(), slab.data.get() + read_start, read_end - read_start);
+      read_end -= read_start;
+      read_start = 0;
+    } else if (slab.size < io::SlabPool::MAX_SLAB) {
+      // the consumer holds a whole buffer waiting for more
+      resize(slab.size * 2);
+    } else {
+      Close(io::asio::error::message_size);
+      return;
+    }
+  }
+
+  sock->async_read_some(io::asio::buffer(slab.data.get() + read_end, slab.size - read_end),
+    boost::bind(&io::SSLClient::_read_handler, this,
+      io::asio::placeholders::error,
+      io::asio::placeholders::bytes_transferred));
+}
+
 void io::SSLClient::_read_handler(const io::error_code& err, std::size_t size) {
   if (err) {
+    service.getSlabs().release(slab);
+    read_start = read_end = 0;
     Close(err);
-  } else {
-    builder.insert(builder.end(), buffer.data(), buffer.data() + size);
-    if (size < buffer.max_size()) {
-      on_read(builder);
-      builder.clear();
-    }
-    sock->async_read_some(io::asio::buffer(buffer),
-      boost::bind(&io::SSLClient::_read_handler, this,
-        io::asio::placeholders::error,
-        io::asio::placeholders::bytes_transferred));
+    return;
   }
+
+  const bool filled = read_end + size == slab.size;
+  read_end += size;
+  const std::size_t consumed = on_read(slab.data.get() + read_start, read_end - read_start);
+  read_start += std::min(consumed, read_end - read_start);
+  if (read_start == read_end)
+    read_start = read_end = 0;
+  if (!connected) return;
+
+  // a read that filled the buffer likely left more behind, while a long
+  // run of small ones means the buffer can give memory back
+  if (filled && slab.size < read_cap) {
+    small_reads = 0;
+    resize(slab.size * 2);
+  } else if (size < slab.size / 4 && slab.size > io::SlabPool::MIN_SLAB) {
+    if (++small_reads >= 64 && read_end - read_start <= slab.size / 2) {
+      small_reads = 0;
+      resize(slab.size / 2);
+    }
+  } else small_reads = 0;
+
+  startRead();
 }
 
 void io::SSLClient::Connect(const std::string& host, int port) {
   if (connected) return;
+  if (shutting_down) {
+    after_shutdown = [this, host, port]() { Connect(host, port); };
+    return;
+  }
+  newStream();
   service.Resolve(host, port,
-  [&](const io::error_code& err, io::tcp::resolver::iterator it) {
+  [this, host](const io::error_code& err, io::tcp::resolver::iterator it) {
     if (err) {
       on_connect(err);
       return;
     }
-    _connect(*it, it, [this](const io::error_code &err) {
+    _connect(*it, it, [this, host](const io::error_code &err) {
+      if (err) {
+        on_connect(err);
+        return;
+      }
+      SSL *ssl = sock->native_handle();
+      SSL_set_tlsext_host_name(ssl, host.c_str());
+      service.getSessions().Offer(host, ssl);
+
+      const auto start = std::chrono::steady_clock::now();
       sock->async_handshake(io::ssl::stream_base::client,
-      [this](const io::error_code &err) {
+      [this, host, start](const io::error_code &err) {
+        // a handshake that read nothing from the server did not happen,
+        // whatever it returned: keep it out of the stats
+        if (BIO_number_read(SSL_get_rbio(sock->native_handle())) == 0) {
+          on_connect(err ? err : io::asio::error::connection_aborted);
+          return;
+        }
+        io::HandshakeStats &stats = service.handshakeStats();
+        handshake_micros = static_cast<long>(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start).count());
+        stats.handshakes++;
+        stats.micros += handshake_micros;
+        if (err) {
+          // a stale session may be why, don't offer it again
+          stats.failed++;
+          service.getSessions().Forget(host);
+          on_connect(err);
+          return;
+        }
+        if (isResumed()) stats.resumed++;
+
         connected = true;
         on_connect(err);
-        sock->async_read_some(io::asio::buffer(buffer),
-          boost::bind(&io::SSLClient::_read_handler, this,
-            io::asio::placeholders::error,
-            io::asio::placeholders::bytes_transferred));
+        startRead();
       });
     });
   });
-}
\ No newline at end of file
+}
@@ -1,7 +1,8 @@
 #include "items/user.hh"
 
 void valk::User::from(const io::json& data) {
-
+  if (data.find("id") != data.end())
+    id = valk::ToSnowflake(data["id"]);
 }
 
 void valk::Member::from(const io::json& data) {
@@ -1,6 +1,7 @@
 #include "io/ws.hh"
 #include "io/b64.hh"
-#include <iostream>
+#include "io/log.hh"
+#include "io/mask.hh"
 #include <random>
 
 static std::random_device Rng;
@@ -19,86 +20,127 @@ static inline unsigned char randByte() {
   return (unsigned char)(Rgen(Random));
 }
 
-static inline std::size_t GetFrameSize(const io::Frame &frame) {
-  std::size_t i = 2 + (frame.masked ? 4 : 0) + frame.data.size();
-  if (frame.data.size() >= 0x7e && frame.data.size() < 0xffff) i += 2;
-  else if (frame.data.size() >= 0x10000) i += 8;
-  return i;
+io::FrameParser::FrameParser() {
+  on_frame = [](io::Frame &frame){};
+  on_error = [](const int code, const std::string &reason){};
+  Reset();
 }
 
-static const std::size_t FrameUnpack(io::Frame &frame, const char *data, std::size_t len) {
-  int i, count = 0;
-  std::size_t size = 0;
-  std::size_t offset = 0;
+void io::FrameParser::onFrame(const std::function<void(io::Frame&)> &cb) {
+  on_frame = cb;
+}
+
+void io::FrameParser::onError(const std::function<void(const int, const std::string&)> &cb) {
+  on_error = cb;
+}
+
+void io::FrameParser::Reset() {
+  failed = false;
+  size = 0;
+  filled = 0;
+  needed = 2;
   frame.data.clear();
+  state = io::FrameState::FRAME_HEAD;
+}
 
-  frame.fin  = (data[offset] & 0x80) != 0 ? 1 : 0;
-  frame.rsv1 = (data[offset] & 0x40) != 0 ? 1 : 0;
-  frame.rsv2 = (data[offset] & 0x20) != 0 ? 1 : 0;
-  frame.rsv3 = (data[offset] & 0x10) != 0 ? 1 : 0;
-  frame.opcode = data[offset++] & 0x0f;
-  
-  frame.masked = (data[offset] & 0x80) != 0 ? 1 :0;
-  size = static_cast<std::size_t>(data[offset++] & (~0x80));
-  if (size == 0x7f) count = 8;
-  else if (size == 0x7e) count = 2;
-  if (count > 0) size = 0;
-  while (count-- > 0)
-    size |= (data[offset++] & 0xff) << (8 * count);
-  frame.data.reserve(size);
-  
-  char mask[4];
-  if (frame.masked)
-    for (i = 0; i < 4; i++)
-      mask[i] = data[offset++];
+void io::FrameParser::beginData() {
+  filled = 0;
+  frame.data.resize(size);
+  state = io::FrameState::FRAME_DATA;
+  if (size == 0) finishFrame();
+}
 
-  for (i = 0; i < (signed)size; i++)
-    frame.data.push_back(frame.masked ? 
-     (data[offset + i] ^ mask[i % 4]) : data[offset + i]);
-  return offset + size;
+void io::FrameParser::finishFrame() {
+  on_frame(frame);
+  Reset();
 }
 
-static void FramePack(io::Frame &frame, char *data) {
+void io::FrameParser::Feed(const char *data, std::size_t len) {
+  std::size_t i, count;
+
+  while (len > 0 && !failed) {
+    if (state == io::FrameState::FRAME_DATA) {
+      count = std::min(size - filled, len);
+      if (frame.masked)
+        io::Mask(&frame.data[filled], data, count, mask, filled);
+      else
+        std::memcpy(&frame.data[filled], data, count);
+      filled += count;
+      data += count; len -= count;
+      if (filled == size) finishFrame();
+      continue;
+    }
+
+    // header, extended size and mask are small: gather them across reads
+    count = std::min(needed - filled, len);
+    std::memcpy((state == io::FrameState::FRAME_MASK ? mask : header) + filled, data, count);
+    filled += count;
+    data += count; len -= count;
+    if (filled < needed) return;
+    filled = 0;
+
+    if (state == io::FrameState::FRAME_HEAD) {
+      frame.fin  = (header[0] & 0x80) != 0 ? 1 : 0;
+      frame.rsv1 = (header[0] & 0x40) != 0 ? 1 : 0;
+      frame.rsv2 = (header[0] & 0x20) != 0 ? 1 : 0;
+      frame.rsv3 = (header[0] & 0x10) != 0 ? 1 : 0;
+      frame.opcode = header[0] & 0x0f;
+      frame.masked = (header[1] & 0x80) != 0 ? 1 : 0;
+      size = static_cast<std::size_t>(header[1] & 0x7f);
+      if (size == 0x7e || size == 0x7f) {
+        needed = size == 0x7f ? 8 : 2;
+        state = io::FrameState::FRAME_SIZE;
+        continue;
+      }
+    } else if (state == io::FrameState::FRAME_SIZE) {
+      size = 0;
+      for (i = 0; i < needed; i++)
+        size = (size << 8) | (header[i] & 0xff);
+    } else {
+      beginData();
+      continue;
+    }
+
+    // the length comes from the server: don't let it size our buffer
+    if (size > MAX_FRAME) {
+      failed = true;
+      on_error(1009, "Frame too big");
+      return;
+    }
+    if (frame.masked) {
+      needed = 4;
+      state = io::FrameState::FRAME_MASK;
+    } else beginData();
+  }
+}
+
+// writes the header of a final client frame, masking key included
+static std::size_t FrameHeader(char *out, const unsigned char opcode,
+  const std::size_t size, const char mask[4])
+{
   int i;
   std::size_t offset = 0;
-
-  data[offset] = (char)(frame.fin ? 0x80 : 0);
-  data[offset] |= (frame.rsv1 ? 0x40 : 0);
-  data[offset] |= (frame.rsv2 ? 0x20 : 0);
-  data[offset] |= (frame.rsv3 ? 0x10 : 0);
-  data[offset++] |= (char)(frame.opcode);
-    
-  char masked = (char)(frame.masked ? 0x80 : 0);
-  const std::size_t size = frame.data.size();
+  out[offset++] = static_cast<char>(0x80 | opcode);
   if (size <= 0x7d) {
-    data[offset++] = (char)(masked | size);
-  } else if (size >= 0x7e && size < 65536) {
-    data[offset++] = (char)(masked | 0x7e);
+    out[offset++] = static_cast<char>(0x80 | size);
+  } else if (size < 0x10000) {
+    out[offset++] = static_cast<char>(0x80 | 0x7e);
     for (i = 8; i >= 0; i -= 8)
-      data[offset++] = (char)((size >> i) & 0xff);
+      out[offset++] = static_cast<char>((size >> i) & 0xff);
   } else {
-    data[offset++] = (char)(masked | 0x7f);
+    out[offset++] = static_cast<char>(0x80 | 0x7f);
     for (i = 56; i >= 0; i -= 8)
-      data[offset++] = (char)((size >> i) & 0xff);
-  }
-  
-  unsigned char *mask = nullptr;
-  if (frame.masked) {
-    mask = new unsigned char[4];
-    for (i = 0; i < 4; i++) {
-      mask[i] = randByte();
-      data[offset++] = mask[i];
-    }
+      out[offset++] = static_cast<char>((size >> i) & 0xff);
   }
-  
-  for (i = 0; i < (signed)size; i++)
-    data[offset + i] = (char)(!frame.masked ?
-      frame.data[i] : (frame.data[i] ^ mask[i % 4]));
-  if (mask != nullptr) delete mask;
+  std::memcpy(out + offset, mask, 4);
+  return offset + 4;
 }
 
 io::WebsockClient::WebsockClient(io::Service &service) : service(service) {
   connected = false;
+  reported = true;
+  generation = 0;
+  state = io::WebsockState::CLOSED;
   client = std::make_shared<io::SSLClient>(service);
 }
 
@@ -118,99 +160,185 @@ void io::WebsockClient::onClose(const std::function<void(const int, const std::s
   on_close = cb;
 }
 
+io::FrameSlot* io::WebsockClient::takeSlot() {
+  if (free_slots.empty()) {
+    slots.emplace_back(new io::FrameSlot());
+    return slots.back().get();
+  }
+  io::FrameSlot *slot = free_slots.back();
+  free_slots.pop_back();
+  return slot;
+}
+
+void io::WebsockClient::sendFrame(unsigned char opcode, const char *data,
+  const std::size_t len, const std::function<void()> &done)
+{
+  if (client.get() == nullptr) return;
+
+  char mask[4];
+  for (int i = 0; i < 4; i++)
+    mask[i] = static_cast<char>(randByte());
+
+  io::FrameSlot *slot = takeSlot();
+  slot->header_size = FrameHeader(slot->header, opcode, len, mask);
+  slot->payload.resize(len);
+  if (len > 0) io::Mask(slot->payload.data(), data, len, mask);
+
+  client->Send(io::asio::buffer(slot->header, slot->header_size),
+    io::asio::buffer(slot->payload), [this, slot, done](const io::error_code &err) {
+    // don't let one huge message pin its buffer forever
+    if (slot->payload.capacity() > io::FrameSlot::MAX_KEPT)
+      std::vector<char>().swap(slot->payload);
+    free_slots.push_back(slot);
+    if (done) done();
+  });
+}
+
 void io::WebsockClient::Send(const std::string &data, unsigned char opcode) {
-  if (connected) {
-    io::Frame frame;
-    frame.fin = true;
-    frame.masked = true;
-    frame.opcode = opcode;
-    frame.data.insert(frame.data.begin(), data.begin(), data.end());
-    
-    const std::size_t frame_size = GetFrameSize(frame);
-    char buffer[frame_size] = { 0 };
-    FramePack(frame, buffer);
-    if (client.get() != nullptr && state == io::WebsockState::OPEN)
-      client->Send(buffer, frame_size);
+  Send(data.data(), data.size(), opcode);
+}
+
+void io::WebsockClient::Send(const char *data, const std::size_t len, unsigned char opcode) {
+  if (connected && state == io::WebsockState::OPEN)
+    sendFrame(opcode, data, len);
+}
+
+// 1005 means the peer sent no code, and must not go on the wire itself
+void io::WebsockClient::sendClose(int status, const std::string &reason,
+  const std::function<void()> &done)
+{
+  char payload[0x7d];
+  std::size_t len = 0;
+  if (status != 1005) {
+    len = 2 + std::min<std::size_t>(reason.size(), sizeof(payload) - 2);
+    payload[0] = static_cast<char>((status >> 8) & 0xff);
+    payload[1] = static_cast<char>((status >> 0) & 0xff);
+    std::memcpy(payload + 2, reason.data(), len - 2);
   }
+
+  connected = false;
+  state = io::WebsockState::CLOSED;
+  sendFrame(io::Opcode::CLOSE, payload, len, done);
 }
 
+// Starts the closing handshake; the socket is closed once the server
+// answers. A server that never does is cut off after CLOSE_TIMEOUT.
 void io::WebsockClient::Close(int status, const std::string &reason) {
-  if (connected) {
-    io::Frame frame;
-    frame.fin = true;
-    frame.masked = false;
-    frame.opcode = io::Opcode::CLOSE;
-    frame.data.reserve(2 + reason.size());
-    frame.data.push_back(static_cast<char>((status >> 8) & 0xff));
-    frame.data.push_back(static_cast<char>((status >> 0) & 0xff));
-    frame.data.insert(frame.data.end(), reason.begin(), reason.end());
-    
-    connected = false;
-    state = io::WebsockState::CLOSED;
-    const std::size_t frame_size = GetFrameSize(frame);
-    char buffer[frame_size] = { 0 };
-    FramePack(frame, buffer);
-    if (client.get() != nullptr)
-      client->Send(buffer, frame_size);
-  }
+  if (!connected) return;
+  sendClose(status, reason, nullptr);
+  const std::size_t current = generation;
+  service.spawn(CLOSE_TIMEOUT, nullptr, [this, current](io::Timer *timer) {
+    if (current == generation && !reported)
+      client->Abort(io::asio::error::timed_out);
+    delete timer;
+  });
 }
 
-void io::WebsockClient::processFrame(const io::Frame &frame) {
-  if (!frame.fin || frame.opcode == io::Opcode::CONT) {
-    builder.insert(builder.end(), frame.data.begin(), frame.data.end());
-    return;
-  } else {
-    if (builder.size() > 0) {
-      builder.insert(builder.end(), frame.data.begin(), frame.data.end());
-      frame.data = builder;
+// sends CLOSE without waiting for an answer. Closing the socket right away
+// would cancel the frame with the rest of the queued writes, so that
+// happens once it is written.
+void io::WebsockClient::drop(int status, const std::string &reason) {
+  if (!connected) return;
+  sendClose(status, reason, [this, status, reason]() {
+    finish(status, reason);
+  });
+}
+
+void io::WebsockClient::finish(int status, const std::string &reason) {
+  if (reported) return;
+  reported = true;
+  connected = false;
+  state = io::WebsockState::CLOSED;
+  client->Close(io::Success, false);
+  on_close(status, reason);
+}
+
+void io::WebsockClient::processFrame(io::Frame &frame) {
+  // past our CLOSE only the answer to it matters
+  if (state != io::WebsockState::OPEN && frame.opcode != io::Opcode::CLOSE) return;
+
+  // control frames may arrive between the fragments of a message
+  if (frame.opcode < io::Opcode::CLOSE && (!frame.fin || frame.opcode == io::Opcode::CONT)) {
+    if (frame.opcode != io::Opcode::CONT)
+      builder_opcode = frame.opcode;
+    if (builder.size() + frame.data.size() > MAX_MESSAGE) {
       builder.clear();
+      LOG_WARN("Websocket message over " << MAX_MESSAGE << " bytes");
+      drop(1009, "Message too big");
+      return;
     }
-    if (frame.opcode == io::Opcode::CLOSE) {
-      int code = ((frame.data[0] >> 8) & 0xff) | ((frame.data[1] >> 8) & 0xff);
-      std::string reason(frame.data.begin() + 2, frame.data.end());
-      if (state == io::WebsockState::OPEN)
-        Close(code, reason);
-      client->Close(io::Success);
-      on_close(code, reason);
-    } else if (frame.opcode == io::Opcode::PING) {
-      Send(std::string(frame.data.begin(), frame.data.end()), io::Opcode::PONG);
-    } else if (frame.opcode == io::Opcode::PONG) {
-
-    } else on_frame(frame);
+    builder.insert(builder.end(), frame.data.begin(), frame.data.end());
+    if (!frame.fin) return;
+    frame.data.swap(builder);
+    frame.opcode = builder_opcode;
+    builder.clear();
   }
+
+  if (frame.opcode == io::Opcode::CLOSE) {
+    int code = 1005;
+    std::string reason;
+    if (frame.data.size() >= 2) {
+      code = ((frame.data[0] & 0xff) << 8) | (frame.data[1] & 0xff);
+      reason.assign(frame.data.begin() + 2, frame.data.end());
+    }
+    // the server started the handshake: answer it. Otherwise this is the
+    // answer to ours and the socket can go right away.
+    if (state == io::WebsockState::OPEN) drop(code, reason);
+    else finish(code, reason);
+  } else if (frame.opcode == io::Opcode::PING) {
+    Send(frame.data.data(), frame.data.size(), io::Opcode::PONG);
+  } else if (frame.opcode == io::Opcode::PONG) {
+
+  } else on_frame(frame);
 }
 
 void io::WebsockClient::Connect(const std::string &url) {
   uri.Parse(url);
+  parser.Reset();
+  builder.clear();
+  generation++;
+  reported = false;
+  state = io::WebsockState::CONNECTING;
+
+  parser.onFrame([this](io::Frame &frame) {
+    processFrame(frame);
+  });
+
+  parser.onError([this](const int code, const std::string &reason) {
+    LOG_WARN("Websocket frame refused: " << reason);
+    drop(code, reason);
+  });
+
+  client->onClose([this](const io::error_code &err) {
+    finish(1006, err ? err.message() : "Connection lost");
+  });
+
+  client->onRead([this](const char *data, const std::size_t len) -> std::size_t {
+    // frames keep coming after our CLOSE, the answer to it among them
+    if (state == io::WebsockState::CONNECTING) {
+      // keep the upgrade response buffered until all of it arrived
+      static const char *END = "\r\n\r\n";
+      const char *end = std::search(data, data + len, END, END + 4);
+      if (end == data + len) return 0;
 
-  client->onRead([this](const std::vector<char> &data) {
-    if (!connected) {
-      std::string header(data.begin(), data.end());
-      if (header.find("HTTP/1.1 101") == 0) {
+      if (len >= 12 && std::memcmp(data, "HTTP/1.1 101", 12) == 0) {
         connected = true;
         state = io::WebsockState::OPEN;
-      } else {
-        on_close(1005, "");
-        client->Close(io::Success);
-      }
+        // frames may follow the upgrade response in the same read
+        const std::size_t header = static_cast<std::size_t>(end - data) + 4;
+        if (header < len) parser.Feed(data + header, len - header);
+      } else finish(1005, "");
 
     } else {
-      std::cout << "Received: ";
-      std::cout.write(&data[0], data.size());
-      std::cout << std::endl;
-
-      std::size_t unpacked = FrameUnpack(frame, &data[0], data.size());
-      processFrame(frame);
-      while (unpacked < data.size()) {
-        unpacked = FrameUnpack(frame, &data[0], data.size());
-      }
+      LOG_TRACE("Received " << len << " bytes");
+      parser.Feed(data, len);
     }
+    return len;
   });
 
   client->onConnect([this](const io::error_code &err) {
     if (err) {
-      state = io::WebsockState::CLOSED;
-      on_close(1005, "Failed to connect");
+      finish(1005, "Failed to connect");
       return;
     }
 
@@ -0,0 +1,133 @@
+#include "io/zlib.hh"
+#include <cstring>
+
+static const unsigned char ZLIB_SUFFIX[4] = { 0x00, 0x00, 0xff, 0xff };
+
+io::ZlibStream::ZlibStream() : failed(false), complete(false), length(0) {
+  std::memset(&strm, 0, sizeof(strm));
+  inflateInit(&strm);
+  output.resize(CHUNK);
+}
+
+io::ZlibStream::~ZlibStream() {
+  inflateEnd(&strm);
+}
+
+void io::ZlibStream::Reset() {
+  inflateReset(&strm);
+  failed = false;
+  complete = false;
+  length = 0;
+}
+
+const bool io::ZlibStream::hasFailed() const {
+  return failed;
+}
+
+const char* io::ZlibStream::data() const {
+  return output.data();
+}
+
+const std::size_t io::ZlibStream::size() const {
+  return length;
+}
+
+bool io::ZlibStream::Feed(const char *data, const std::size_t len) {
+  if (complete || failed) {
+    complete = false;
+    length = 0;
+  }
+
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  strm.avail_in = static_cast<uInt>(len);
+  while (strm.avail_in > 0) {
+    if (output.size() - length < CHUNK)
+      output.resize(output.size() * 2);
+    strm.next_out = reinterpret_cast<Bytef*>(&output[length]);
+    strm.avail_out = static_cast<uInt>(output.size() - length);
+
+    const int status = inflate(&strm, Z_SYNC_FLUSH);
+    length = output.size() - strm.avail_out;
+    if (status != Z_OK && status != Z_BUF_ERROR) {
+      failed = true;
+      return false;
+    }
+    if (status == Z_BUF_ERROR && strm.avail_out > 0) break;
+  }
+
+  complete = len >= 4 && std::memcmp(data + len - 4, ZLIB_SUFFIX, 4) == 0;
+  return complete;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+
+io::GzipDeflater::GzipDeflater(const int lvl) : level(lvl) {
+  std::memset(&strm, 0, sizeof(strm));
+  deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+}
+
+io::GzipDeflater::~GzipDeflater() {
+  deflateEnd(&strm);
+}
+
+void io::GzipDeflater::setLevel(const int lvl) {
+  if (lvl == level) return;
+  level = lvl;
+  deflateReset(&strm);
+  deflateParams(&strm, level, Z_DEFAULT_STRATEGY);
+}
+
+const std::string& io::GzipDeflater::Compress(const char *data, const std::size_t len) {
+  deflateReset(&strm);
+  output.resize(deflateBound(&strm, len));
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  strm.avail_in = static_cast<uInt>(len);
+  strm.next_out = reinterpret_cast<Bytef*>(&output[0]);
+  strm.avail_out = static_cast<uInt>(output.size());
+  deflate(&strm, Z_FINISH);
+  output.resize(output.size() - strm.avail_out);
+  return output;
+}
+
+////////////////////////////////////////////////////////////////////////
+
+io::GzipInflater::GzipInflater() : failed(false) {
+  std::memset(&strm, 0, sizeof(strm));
+  inflateInit2(&strm, 15 + 32);
+}
+
+io::GzipInflater::~GzipInflater() {
+  inflateEnd(&strm);
+}
+
+void io::GzipInflater::Reset() {
+  inflateReset(&strm);
+  failed = false;
+}
+
+const bool io::GzipInflater::hasFailed() const {
+  return failed;
+}
+
+bool io::GzipInflater::Feed(const char *data, const std::size_t len, std::string &out) {
+  if (failed) return false;
+  strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  strm.avail_in = static_cast<uInt>(len);
+
+  while (strm.avail_in > 0) {
+    const std::size_t used = out.size();
+    out.resize(used + std::max<std::size_t>(len * 4, 4096));
+    strm.next_out = reinterpret_cast<Bytef*>(&out[used]);
+    strm.avail_out = static_cast<uInt>(out.size() - used);
+
+    const int status = inflate(&strm, Z_NO_FLUSH);
+    out.resize(out.size() - strm.avail_out);
+    if (status == Z_STREAM_END) break;
+    if (status != Z_OK && status != Z_BUF_ERROR) {
+      failed = true;
+      return false;
+    }
+  }
+  return true;
+}
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "identify.hh"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+// A shard loop has nothing of its own to run while its shard waits in the
+// identify queue. The queue must hold it open, or the start posted to it
+// later is dropped, and let go once the shard is cancelled.
+
+#define CHECK(cond) do { if (!(cond)) { \
+  std::fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); std::exit(1); } } while (0)
+
+int main() {
+  io::Service main_loop;
+  io::Service shard_loop;
+  valk::IdentifyQueue queue(main_loop);
+  queue.onProgress([](const std::size_t, const std::size_t) {});
+  queue.Configure(io::json({{"max_concurrency", 1}, {"remaining", 10}}), 3);
+
+  std::atomic<int> started(0);
+  std::thread::id ran_on;
+  queue.Push(0, shard_loop, [&]() { started++; });
+  // shard 1 only gets its turn IDENTIFY_DELAY later, with the loop idle
+  queue.Push(1, shard_loop, [&]() {
+    ran_on = std::this_thread::get_id();
+    started++;
+    main_loop.getService().stop();
+  });
+
+  std::thread shard([&]() { shard_loop.Run(); });
+  const std::thread::id shard_id = shard.get_id();
+  main_loop.Run();
+  // once both starts ran nothing holds the loop, so Run returns
+  shard.join();
+  CHECK(started == 2);
+  CHECK(ran_on == shard_id);
+
+  // a cancelled shard lets go of the loop as well
+  main_loop.getService().restart();
+  shard_loop.getService().restart();
+  queue.Push(2, shard_loop, [&]() { started++; });
+  queue.Cancel(2);
+  main_loop.getService().poll();
+  CHECK(queue.pending() == 0);
+  shard_loop.getService().run_for(std::chrono::seconds(1));
+  CHECK(shard_loop.getService().stopped());
+  CHECK(started == 2);
+
+  std::printf("identify: ok\n");
+  return 0;
+}